@@ -37,7 +37,6 @@
  */
 
 #include "Descriptors.h"
-#include "requests.h"
 
 
 /** Device descriptor structure. This descriptor, located in FLASH memory, describes the overall
@@ -96,7 +95,7 @@ const USB_Descriptor_Configuration_t PROGMEM RelayBoard_ConfigurationDescriptor
 			.InterfaceNumber        = 0,
 			.AlternateSetting       = 0,
 
-			.TotalEndpoints         = 0,
+			.TotalEndpoints         = SUPPORT_STREAMING,
 
 			.Class                  = USB_CSCP_VendorSpecificClass,
 			.SubClass               = 0x00,
@@ -104,6 +103,18 @@ const USB_Descriptor_Configuration_t PROGMEM RelayBoard_ConfigurationDescriptor
 
 			.InterfaceStrIndex      = NO_DESCRIPTOR
 		},
+
+#if SUPPORT_STREAMING
+	.StreamOUTEndpoint =
+		{
+			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+			.EndpointAddress        = (ENDPOINT_DESCRIPTOR_DIR_OUT | NIXIE_STREAM_EPNUM),
+			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+			.EndpointSize           = NIXIE_STREAM_EPSIZE,
+			.PollingIntervalMS      = 1
+		},
+#endif
 };
 
 /** Language descriptor structure. This descriptor, located in FLASH memory, is returned when the host requests
@@ -139,14 +150,19 @@ const USB_Descriptor_String_t PROGMEM RelayBoard_ProductString =
 	.UnicodeString          = L"Nixie"
 };
 
+/* set by the Makefile, boards forming one display need distinct serials */
+#ifndef NIXIE_SERIAL
+#define NIXIE_SERIAL L"00001"
+#endif
+
 /** Serial number string. This is a Unicode string containing the device's unique serial number, expressed as a
  *  series of uppercase hexadecimal digits.
  */
 const USB_Descriptor_String_t PROGMEM RelayBoard_SerialString =
 {
-	.Header                 = {.Size = USB_STRING_LEN(5), .Type = DTYPE_String},
+	.Header                 = {.Size = USB_STRING_LEN(sizeof(NIXIE_SERIAL)/sizeof(wchar_t) - 1), .Type = DTYPE_String},
 
-	.UnicodeString          = L"00001"
+	.UnicodeString          = NIXIE_SERIAL
 };
 
 /** This function is called by the library when in device mode, and must be overridden (see library "USB Descriptors"
@@ -41,6 +41,14 @@
 		#include <avr/pgmspace.h>
 		#include <LUFA/Drivers/USB/USB.h>
 
+		#include "requests.h"
+
+	/* Macros: */
+		/** Set to 0 to build a control-only device without the frame streaming endpoint. */
+		#ifndef SUPPORT_STREAMING
+			#define SUPPORT_STREAMING 1
+		#endif
+
 	/* Type Defines: */
 		/** Type define for the device configuration descriptor structure. This must be defined in the
 		 *  application code, as the configuration descriptor contains several sub-descriptors which
@@ -52,6 +60,9 @@
 
 			// Relay Board Interface
 			USB_Descriptor_Interface_t            RelayBoardInterface;
+			#if SUPPORT_STREAMING
+			USB_Descriptor_Endpoint_t             StreamOUTEndpoint;
+			#endif
 		} USB_Descriptor_Configuration_t;
 
 	/* Function Prototypes: */
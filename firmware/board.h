@@ -0,0 +1,41 @@
+/* Pin mapping of the nixie board. NIXIE_BOARD names the board
+ * description (see boards/) to use, each of which defines:
+ * - BOARD_ANODES(X): X(port, bit) for the anode of each tube, from the
+ *   first tube on; an anode is switched on by pulling the pin low
+ * - BOARD_BCD_PORT, BOARD_BCD_A..D: the inputs of the BCD decoder
+ * - BOARD_LED_PORT, BOARD_LED_R/G/B: the LEDs, shared by all tubes
+ */
+
+#ifndef __BOARD_H_INCLUDED__
+#define __BOARD_H_INCLUDED__
+
+#include "requests.h"
+
+#ifndef NIXIE_BOARD
+#define NIXIE_BOARD "boards/nixie3.h"
+#endif
+#include NIXIE_BOARD
+
+#define BOARD_PORT_(p) PORT##p
+#define BOARD_DDR_(p) DDR##p
+#define BOARD_PORT(p) BOARD_PORT_(p)
+#define BOARD_DDR(p) BOARD_DDR_(p)
+
+#define BOARD_COUNT(p, b) +1
+#define N_NIXIES (0 BOARD_ANODES(BOARD_COUNT))
+
+#if N_NIXIES < 1 || N_NIXIES > NIXIE_MAX_TUBES
+#error "the board must have between 1 and NIXIE_MAX_TUBES tubes"
+#endif
+
+#define BOARD_BCD_MASK (1<<BOARD_BCD_A | 1<<BOARD_BCD_B | 1<<BOARD_BCD_C | 1<<BOARD_BCD_D)
+/* the decoder inputs set for the digit v */
+#define BOARD_BCD_BITS(v) ( \
+	((v) & 1<<0 ? 1<<BOARD_BCD_A : 0) | \
+	((v) & 1<<1 ? 1<<BOARD_BCD_B : 0) | \
+	((v) & 1<<2 ? 1<<BOARD_BCD_C : 0) | \
+	((v) & 1<<3 ? 1<<BOARD_BCD_D : 0))
+
+#define BOARD_LED_MASK (1<<BOARD_LED_R | 1<<BOARD_LED_G | 1<<BOARD_LED_B)
+
+#endif /* __BOARD_H_INCLUDED__ */
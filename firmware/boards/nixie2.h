@@ -0,0 +1,14 @@
+/* The original board fitted with two tubes only */
+
+#define BOARD_ANODES(X) X(B, 7) X(B, 6)
+
+#define BOARD_BCD_PORT B
+#define BOARD_BCD_A 3
+#define BOARD_BCD_B 1
+#define BOARD_BCD_C 0
+#define BOARD_BCD_D 2
+
+#define BOARD_LED_PORT D
+#define BOARD_LED_R 4
+#define BOARD_LED_G 1
+#define BOARD_LED_B 0
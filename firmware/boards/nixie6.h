@@ -0,0 +1,16 @@
+/* Two chained boards with three tubes each, the anodes of the second
+ * board are wired to PB4 and PC7..PC6
+ */
+
+#define BOARD_ANODES(X) X(B, 7) X(B, 6) X(B, 5) X(B, 4) X(C, 7) X(C, 6)
+
+#define BOARD_BCD_PORT B
+#define BOARD_BCD_A 3
+#define BOARD_BCD_B 1
+#define BOARD_BCD_C 0
+#define BOARD_BCD_D 2
+
+#define BOARD_LED_PORT D
+#define BOARD_LED_R 4
+#define BOARD_LED_G 1
+#define BOARD_LED_B 0
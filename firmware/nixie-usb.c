@@ -3,19 +3,81 @@
 #include <util/delay.h>
 #include <avr/wdt.h>
 #include <avr/power.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <string.h>
 
 #include <LUFA/Version.h>
 #include <LUFA/Drivers/USB/USB.h>
 
 #include "requests.h" /* custom requests used */
+#include "Descriptors.h"
+#include "board.h"
 
-#define N_NIXIES 3
-
+/* The at90usb162 has 512 bytes of RAM (see ramcheck in the Makefile),
+ * boards with more tubes leave out the features that need the most of
+ * it unless they are asked for. */
 #ifndef SUPPORT_ANIMATION
 #define SUPPORT_ANIMATION 1
 #endif
 
+#ifndef SUPPORT_SEQUENCER
+#define SUPPORT_SEQUENCER (N_NIXIES <= 6)
+#endif
+#ifndef SUPPORT_COUNTER
+#define SUPPORT_COUNTER 1
+#endif
+/* fade LEDs on the device (CUSTOM_RQ_CONST_LED_FADE) */
+#ifndef SUPPORT_LED_FADE
+#define SUPPORT_LED_FADE (N_NIXIES <= 3)
+#endif
+/* set the multiplex rate and the brightness of the tubes at run time
+ * (CUSTOM_RQ_CONST_MUX, CUSTOM_RQ_CONST_BRIGHTNESS) */
+#ifndef SUPPORT_MUX
+#define SUPPORT_MUX 1
+#endif
+/* apply a gamma of 2 to the LED values, so that fades look even */
+#ifndef LED_GAMMA
+#define LED_GAMMA 0
+#endif
+/* time the main loop and the request handler (CUSTOM_RQ_GET_STATS) */
+#ifndef SUPPORT_STATS
+#define SUPPORT_STATS (N_NIXIES <= 3)
+#endif
+
+/* bytes of RAM for sequencer programs */
+#ifndef SEQUENCE_SIZE
+#define SEQUENCE_SIZE (N_NIXIES <= 3 ? 64 : 32)
+#endif
+
+/* LED PWM resolution (in bits, at most 7) and frequency */
+#ifndef LED_PWM_BITS
+#define LED_PWM_BITS 6
+#endif
+#ifndef LED_PWM_HZ
+#define LED_PWM_HZ 400
+#endif
+/* number of LED PWM periods each tube stays lit */
+#ifndef MUX_PWM_PERIODS
+#define MUX_PWM_PERIODS 2
+#endif
+
+#define PWM_STEPS (1<<LED_PWM_BITS)
+/* timer 0 runs at F_CPU/64 and fires once per PWM step */
+#define PWM_OCR ((F_CPU/64 + LED_PWM_HZ*PWM_STEPS/2UL) / (LED_PWM_HZ*PWM_STEPS*1UL) - 1)
+
+#if LED_PWM_BITS < 1 || LED_PWM_BITS > 7
+#error "LED_PWM_BITS must be between 1 and 7"
+#endif
+#if PWM_OCR < 4 || PWM_OCR > 255
+#error "LED_PWM_HZ and LED_PWM_BITS do not fit timer 0"
+#endif
+/* timer 0 steps each tube is lit for */
+#define SLOT_STEPS (MUX_PWM_PERIODS * PWM_STEPS)
+
+/* any value above 9 blanks a tube */
+#define NIXIE_OFF 10
+
 /* these are the values currently being displayed */
 static uint8_t nixie_val[N_NIXIES] = {0};
 
@@ -26,8 +88,8 @@ static uint8_t nixie_set[N_NIXIES] = {0};
 static uint8_t animated_tube = 0;
 
 /* order of the layered electrodes */
-static const uint8_t nixie_level[10+1] = {
-	10, // OFF!
+static const uint8_t nixie_level[10+1] PROGMEM = {
+	NIXIE_OFF,
 	1,
 	2,
 	6,
@@ -42,79 +104,639 @@ static const uint8_t nixie_level[10+1] = {
 
 static uint8_t animation_style = CUSTOM_RQ_CONST_ANIMATION_LEVEL;
 static uint8_t animation_speed = 8;
+
+/* animation steps a crossfade takes */
+#define FADE_STEPS 32
+/* the digit faded from, shown for the first fade_split steps of each
+ * PWM period, and the progress of the fade */
+static volatile uint8_t fade_from[N_NIXIES];
+static volatile uint8_t fade_split[N_NIXIES] = {0};
+static uint8_t fade_pos[N_NIXIES];
 #endif
 
 static uint8_t led_val[N_NIXIES][3] = { {0,0,0} };
-static uint8_t led_pwm[N_NIXIES] = {0};
+/* led_val scaled to PWM_STEPS */
+static uint8_t led_duty[N_NIXIES][3] = { {0,0,0} };
+
+#if SUPPORT_LED_FADE
+/* the committed colors, the position of fading LEDs in 8.7 fixed point
+ * and the ticks left until they reach their color */
+static uint8_t led_target[N_NIXIES][3];
+static uint16_t led_pos[N_NIXIES][3];
+static uint16_t led_fade_left[N_NIXIES];
+#endif
+
+/* the tube currently lit */
+static uint8_t m_tube = 0;
+
+#if SUPPORT_MUX
+/* the steps at the start of a slot all tubes stay off while the digit
+ * changes, and the steps at its end each tube is dimmed by */
+static volatile uint16_t mux_blank = 0;
+static volatile uint16_t mux_dim[N_NIXIES];
+/* percent of the slot after the blanking each tube is lit for */
+static uint8_t brightness[N_NIXIES];
+/* m_tube is switched on */
+static uint8_t m_on = 0;
+#endif
+
+/* updates received from the host, shown from the next multiplex cycle on */
+static struct {
+	uint8_t tube[N_NIXIES];
+	uint8_t led[N_NIXIES][3];
+#if SUPPORT_LED_FADE
+	/* ticks to fade the LED to its new color in, 0 to set it at once */
+	uint16_t led_fade[N_NIXIES];
+#endif
+	uint8_t animation_style;
+	uint8_t animation_speed;
+} pending = {
+	.animation_style = CUSTOM_RQ_CONST_ANIMATION_LEVEL,
+	.animation_speed = 8,
+};
+
+/* the pending values are complete and should be shown, the PWM
+ * interrupt commits them */
+static volatile uint8_t commit_pending = 0;
+/* keep collecting updates until the host commits them */
+static volatile uint8_t hold = 0;
 
-/* enough time has passed to switch to the next tube */
-static volatile uint8_t time_passed = 1;
+/* keep the compiler from moving memory accesses across it */
+#define barrier() __asm__ __volatile__ ("" ::: "memory")
+
+/* control requests are received in the USB interrupt and applied from the main loop */
+#define QUEUE_SIZE 4
+#define QUEUE_DATA (CUSTOM_RQ_FRAME_SIZE(N_NIXIES) > 8 ? CUSTOM_RQ_FRAME_SIZE(N_NIXIES) : 8)
+#if QUEUE_DATA < CUSTOM_RQ_SEQUENCE_CHUNK
+#error "QUEUE_DATA cannot hold a sequence chunk"
+#endif
+static struct {
+	uint8_t request;
+	uint8_t len;
+	uint16_t value;
+	uint8_t index;
+	uint8_t seq;
+	uint8_t data[QUEUE_DATA];
+} queue[QUEUE_SIZE];
+static volatile uint8_t queue_head = 0;
+static volatile uint8_t queue_tail = 0;
+/* numbers of the last request received and applied, see CUSTOM_RQ_GET_ACK */
+static uint8_t received_seq = 0;
+static volatile uint8_t applied_seq = 0;
 
 /* enough time has passed to show the next animation phase */
 static volatile uint8_t animation_step = 0;
 
-static uint8_t process_usb_data(uint8_t *data, uint8_t len) {
-	if (len > 2) {
-		if (data[0] == CUSTOM_RQ_CONST_TUBE && data[1] < N_NIXIES) {
+#if SUPPORT_SEQUENCER
+static uint8_t sequence[SEQUENCE_SIZE];
+/* position of the next step and of the loop mark */
+static uint8_t seq_pc = 0;
+static uint8_t seq_mark = 0;
+/* ticks left to wait before the next step */
+static uint16_t seq_wait = 0;
+static uint8_t seq_running = 0;
+#endif
+
+#if SUPPORT_COUNTER
+static uint32_t counter_value = 0;
+/* ticks between steps, 0 if the counter is stopped */
+static uint16_t counter_period = 0;
+static uint16_t counter_wait = 0;
+static uint8_t counter_flags = 0;
+#endif
+
+/* a 5ms tick has passed */
+static volatile uint8_t tick = 0;
+/* ticks since the start, see CUSTOM_RQ_GET_CLOCK */
+static volatile uint32_t frame = 0;
+/* the pending updates are held until commit_frame */
+static uint32_t commit_frame;
+static uint8_t commit_at = 0;
+
+/* Timer1 counts at F_CPU/8 and wraps at the tick, after TIMER1_TOP+1 counts */
+#define TIMER1_TOP (F_CPU/8/200 - 1)
+
+#if SUPPORT_STATS
+static struct nixie_stats stats;
+/* the host asked for the counters to be cleared */
+static volatile uint8_t stats_reset = 0;
+
+static inline uint16_t timer_now(void) {
+	uint16_t t;
+	/* the high byte of TCNT1 is buffered, an interrupt reading it must not get in between */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		t = TCNT1;
+	}
+	return t;
+}
+
+/* account the timer cycles since start, longer than a tick is not told apart */
+static void account(struct nixie_timing *t, uint16_t start) {
+	uint16_t now = timer_now();
+	uint16_t d = (now >= start) ? now - start : now + (TIMER1_TOP+1) - start;
+	if (d < t->min || !t->count) t->min = d;
+	if (d > t->max) t->max = d;
+	t->sum += d;
+	t->count++;
+}
+
+#define TIME_START(v) uint16_t v = timer_now()
+#define TIME_END(v, t) account(&stats.t, v)
+#else
+#define TIME_START(v)
+#define TIME_END(v, t)
+#endif
+
+static void store_tube(uint8_t tube, uint8_t value) {
+	pending.tube[tube] = value;
+}
+
+static void store_led(uint8_t tube, uint8_t *rgb) {
+	memcpy(pending.led[tube], rgb, 3);
+#if SUPPORT_LED_FADE
+	pending.led_fade[tube] = 0;
+#endif
+}
+
+#if SUPPORT_LED_FADE
+/* fade the LED of a tube, or all of them, to a color once committed */
+static void fade_led(uint8_t tube, uint8_t *rgb, uint16_t ticks) {
+	uint8_t i;
+	/* fade_leds() divides by the ticks left as a signed value */
+	if (ticks > 0x7fff) ticks = 0x7fff;
+	for (i = 0; i < N_NIXIES; i++) {
+		if (tube != i && tube != CUSTOM_RQ_LED_ALL) continue;
+		memcpy(pending.led[i], rgb, 3);
+		pending.led_fade[i] = ticks;
+	}
+}
+#endif
+
+static void store_animation(uint8_t style, uint8_t speed) {
+	pending.animation_style = style;
+	if (speed > 0) {
+		pending.animation_speed = speed;
+	}
+}
+
+static void request_commit(void) {
+	/* the pending values are written before the interrupt may take them */
+	barrier();
+	if (!hold) {
+		commit_pending = 1;
+	}
+}
+
+/* keep the interrupt from committing while the pending values are modified */
+static void begin_update(void) {
+	commit_pending = 0;
+	barrier();
+}
+
+/* scale the LED values of a tube to PWM_STEPS */
+static void set_duty(uint8_t tube) {
+	uint8_t c;
+	uint16_t v;
+	for (c = 0; c < 3; c++) {
+		v = led_val[tube][c];
+#if LED_GAMMA
+		v = (v * v) >> 8;
+#endif
+		led_duty[tube][c] = (v * PWM_STEPS + 128) >> 8;
+	}
+}
+
+/* swap the pending values in, called from the PWM interrupt at the start of a multiplex cycle */
+static void commit(void) {
+	uint8_t i;
+#if SUPPORT_LED_FADE
+	uint8_t c;
+#endif
 #if SUPPORT_ANIMATION
-			nixie_set[data[1]] = data[2];
+	memcpy(nixie_set, pending.tube, sizeof(nixie_set));
+	animation_style = pending.animation_style;
+	animation_speed = pending.animation_speed;
 #else
-			nixie_val[data[1]] = data[2];
+	memcpy(nixie_val, pending.tube, sizeof(nixie_val));
 #endif
+	for (i = 0; i < N_NIXIES; i++) {
+#if SUPPORT_LED_FADE
+		if (pending.led_fade[i]) {
+			/* fade from the color shown, see fade_leds() */
+			memcpy(led_target[i], pending.led[i], 3);
+			for (c = 0; c < 3; c++) {
+				led_pos[i][c] = led_val[i][c] << 7;
+			}
+			led_fade_left[i] = pending.led_fade[i];
+			pending.led_fade[i] = 0;
+			continue;
+		}
+		/* an unchanged LED keeps fading */
+		if (memcmp(led_target[i], pending.led[i], 3) == 0) continue;
+		memcpy(led_target[i], pending.led[i], 3);
+		led_fade_left[i] = 0;
+#endif
+		memcpy(led_val[i], pending.led[i], 3);
+		set_duty(i);
+	}
+	commit_pending = 0;
+}
+
+#if SUPPORT_COUNTER
+/* show the counter value on the tubes */
+static void show_counter(void) {
+	uint32_t v = counter_value;
+	uint8_t base;
+	uint8_t i;
+	for (i = 0; i < N_NIXIES; i++) {
+		/* tens of seconds and minutes */
+		base = ((counter_flags & CUSTOM_RQ_COUNTER_CLOCK) && (i == 1 || i == 3)) ? 6 : 10;
+		if (i != 0 && v == 0 && !(counter_flags & CUSTOM_RQ_COUNTER_LEADING_ZERO)) {
+			store_tube(i, NIXIE_OFF);
+		} else {
+			store_tube(i, v % base);
+		}
+		v /= base;
+	}
+}
+
+static void stop_counter(void) {
+	counter_period = 0;
+}
+
+static void start_counter(uint8_t flags, uint32_t value, uint16_t period) {
+	if (!period) {
+		/* leave the display as it is */
+		stop_counter();
+		return;
+	}
+	counter_flags = flags;
+	counter_value = value;
+	/* a countdown from zero has already run out */
+	counter_period = (flags & CUSTOM_RQ_COUNTER_DOWN) && !value ? 0 : period;
+	counter_wait = period;
+	show_counter();
+#if SUPPORT_SEQUENCER
+	seq_running = 0;
+#endif
+}
+
+/* step the counter, called once per tick */
+static void run_counter(void) {
+	if (!counter_period || --counter_wait) return;
+	counter_wait = counter_period;
+	if (counter_flags & CUSTOM_RQ_COUNTER_DOWN) {
+		/* a countdown stops at zero */
+		if (counter_value == 0 || --counter_value == 0) counter_period = 0;
+	} else {
+		counter_value++;
+		if ((counter_flags & CUSTOM_RQ_COUNTER_CLOCK) && counter_value == 24*60*60UL) {
+			counter_value = 0;
+		}
+	}
+	begin_update();
+	show_counter();
+	request_commit();
+}
+#else
+static void stop_counter(void) {
+}
+#endif
+
+/* the host sets the tubes, whatever was running them on its own stops */
+static void take_tubes(void) {
+	stop_counter();
+#if SUPPORT_SEQUENCER
+	seq_running = 0;
+#endif
+}
+
+#if SUPPORT_MUX
+static void dim_tube(uint8_t i) {
+	uint16_t dim = (uint32_t) (SLOT_STEPS - mux_blank) * (100 - brightness[i]) / 100;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		mux_dim[i] = dim;
+	}
+}
+
+static void set_brightness(uint8_t tube, uint8_t percent) {
+	uint8_t i;
+	if (percent > 100) percent = 100;
+	for (i = 0; i < N_NIXIES; i++) {
+		if (tube != CUSTOM_RQ_TUBE_ALL && tube != i) continue;
+		brightness[i] = percent;
+		dim_tube(i);
+	}
+}
+
+/* light each tube rate times per second (0 for the built in rate) after
+ * keeping all of them off for blank_us */
+static void set_mux(uint16_t rate, uint16_t blank_us) {
+	uint32_t ocr = PWM_OCR+1;
+	uint16_t blank;
+	uint8_t i;
+	if (rate) {
+		ocr = (F_CPU/64 + (uint32_t) rate * (SLOT_STEPS*N_NIXIES/2)) / ((uint32_t) rate * (SLOT_STEPS*N_NIXIES));
+		if (ocr < 5) ocr = 5;
+		if (ocr > 256) ocr = 256;
+	}
+	blank = ((uint32_t) blank_us * (F_CPU/64000) + ocr*1000 - 1) / (ocr*1000);
+	if (blank >= SLOT_STEPS) blank = SLOT_STEPS-1;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		OCR0A = ocr-1;
+		/* the counter may be past the new top */
+		TCNT0 = 0;
+		mux_blank = blank;
+	}
+	for (i = 0; i < N_NIXIES; i++) {
+		dim_tube(i);
+	}
+}
+#endif
+
+static uint8_t process_usb_data(uint8_t *data, uint8_t len) {
+	if (len > 2) {
+		begin_update();
+		if (data[0] == CUSTOM_RQ_CONST_TUBE && data[1] < N_NIXIES) {
+			take_tubes();
+			store_tube(data[1], data[2]);
 		}
 		if (data[0] == CUSTOM_RQ_CONST_LED && data[1] < N_NIXIES && len >=5) {
-			memcpy(led_val[data[1]], &data[2], 3);
+			store_led(data[1], &data[2]);
 		}
-#if SUPPORT_ANIMATION
+#if SUPPORT_LED_FADE
+		if (data[0] == CUSTOM_RQ_CONST_LED_FADE && len >= 7) {
+			fade_led(data[1], &data[2], data[5] | data[6]<<8);
+		}
+#endif
 		if (data[0] == CUSTOM_RQ_CONST_ANIMATION && len >= 4) {
-			animation_style = data[2];
-			if (data[3] > 0) {
-				animation_speed = data[3];
-			}
+			store_animation(data[2], data[3]);
+		}
+		if (data[0] == CUSTOM_RQ_CONST_HOLD) {
+			hold = 1;
+		}
+		if (data[0] == CUSTOM_RQ_CONST_COMMIT) {
+			hold = 0;
+			commit_at = 0;
+		}
+		if (data[0] == CUSTOM_RQ_CONST_COMMIT_AT && len >= 6) {
+			hold = 1;
+			commit_frame = data[2] | (uint32_t) data[3]<<8 | (uint32_t) data[4]<<16 | (uint32_t) data[5]<<24;
+			commit_at = 1;
+		}
+#if SUPPORT_SEQUENCER
+		if (data[0] == CUSTOM_RQ_CONST_SEQUENCE) {
+			seq_pc = 0;
+			seq_mark = 0;
+			seq_wait = 0;
+			seq_running = data[1];
+			if (seq_running) stop_counter();
+		}
+#endif
+#if SUPPORT_COUNTER
+		if (data[0] == CUSTOM_RQ_CONST_COUNTER && len >= 8) {
+			start_counter(data[1],
+				data[2] | (uint32_t) data[3]<<8 | (uint32_t) data[4]<<16 | (uint32_t) data[5]<<24,
+				data[6] | data[7]<<8);
+		}
+#endif
+#if SUPPORT_MUX
+		if (data[0] == CUSTOM_RQ_CONST_MUX && len >= 6) {
+			set_mux(data[2] | data[3]<<8, data[4] | data[5]<<8);
+		}
+		if (data[0] == CUSTOM_RQ_CONST_BRIGHTNESS) {
+			set_brightness(data[1], data[2]);
 		}
 #endif
+		request_commit();
 	}
 	return 1;
 }
 
+static uint8_t process_frame(uint8_t *data, uint8_t len, uint8_t first, uint8_t count, uint8_t sections) {
+	uint16_t need = 0;
+	uint8_t n = 0;
+	uint8_t i;
+	if (first < N_NIXIES) {
+		n = (count < N_NIXIES-first) ? count : N_NIXIES-first;
+	}
+	/* a short frame is dropped as a whole, before anything is touched */
+	if (sections & CUSTOM_RQ_FRAME_TUBES) need += count;
+	if (sections & CUSTOM_RQ_FRAME_LEDS) need += count*3;
+	if (sections & CUSTOM_RQ_FRAME_ANIMATION) need += 2;
+	if (len < need) return 0;
+	begin_update();
+	if (sections & CUSTOM_RQ_FRAME_TUBES) {
+		take_tubes();
+		for (i = 0; i < n; i++) {
+			store_tube(first+i, data[i]);
+		}
+		data += count;
+	}
+	if (sections & CUSTOM_RQ_FRAME_LEDS) {
+		for (i = 0; i < n; i++) {
+			store_led(first+i, &data[i*3]);
+		}
+		data += count*3;
+	}
+	if (sections & CUSTOM_RQ_FRAME_ANIMATION) {
+		store_animation(data[0], data[1]);
+	}
+	if (sections & CUSTOM_RQ_FRAME_COMMIT) {
+		hold = 0;
+		commit_at = 0;
+	}
+	request_commit();
+	return 1;
+}
+
+/* decoder inputs for each digit */
+static const uint8_t bcd_bits[16] PROGMEM = {
+	BOARD_BCD_BITS(0), BOARD_BCD_BITS(1), BOARD_BCD_BITS(2), BOARD_BCD_BITS(3),
+	BOARD_BCD_BITS(4), BOARD_BCD_BITS(5), BOARD_BCD_BITS(6), BOARD_BCD_BITS(7),
+	BOARD_BCD_BITS(8), BOARD_BCD_BITS(9), BOARD_BCD_BITS(10), BOARD_BCD_BITS(11),
+	BOARD_BCD_BITS(12), BOARD_BCD_BITS(13), BOARD_BCD_BITS(14), BOARD_BCD_BITS(15),
+};
+
+/* anode pin of each tube */
+static const struct {
+	volatile uint8_t *port;
+	uint8_t mask;
+} anode[N_NIXIES] PROGMEM = {
+#define ANODE(p, b) { &BOARD_PORT(p), 1<<(b) },
+	BOARD_ANODES(ANODE)
+#undef ANODE
+};
+
+/* anodes are switched on by pulling them low */
+static void anode_on(uint8_t t) {
+	volatile uint8_t *port = pgm_read_ptr(&anode[t].port);
+	*port &= ~pgm_read_byte(&anode[t].mask);
+}
+
+static void anode_off(uint8_t t) {
+	volatile uint8_t *port = pgm_read_ptr(&anode[t].port);
+	*port |= pgm_read_byte(&anode[t].mask);
+}
+
+#if SUPPORT_SEQUENCER
+static void store_sequence(uint8_t *data, uint8_t len, uint8_t offset) {
+	seq_running = 0;
+	if (offset >= SEQUENCE_SIZE) return;
+	if (len > SEQUENCE_SIZE-offset) len = SEQUENCE_SIZE-offset;
+	memcpy(&sequence[offset], data, len);
+}
+
+/* length of each sequencer step, by opcode */
+static const uint8_t seq_op_len[] PROGMEM = {
+	[SEQ_OP_END] = 1,
+	[SEQ_OP_TUBES] = 1+N_NIXIES,
+	[SEQ_OP_COLOR] = 4,
+	[SEQ_OP_LED] = 5,
+	[SEQ_OP_HOLD] = 3,
+	[SEQ_OP_MARK] = 1,
+	[SEQ_OP_LOOP] = 1,
+};
+
+/* run the sequencer program until the next hold, called once per tick */
+static void run_sequence(void) {
+	uint8_t *op;
+	uint8_t steps = 0;
+	uint8_t i;
+	if (!seq_running || (seq_wait && --seq_wait)) return;
+	begin_update();
+	while (seq_running && !seq_wait) {
+		/* a loop without a hold is continued in the next tick */
+		if (++steps > SEQUENCE_SIZE) {
+			seq_wait = 1;
+			break;
+		}
+		op = &sequence[seq_pc];
+		if (op[0] >= sizeof(seq_op_len) || seq_pc+pgm_read_byte(&seq_op_len[op[0]]) > SEQUENCE_SIZE) {
+			seq_running = 0;
+			break;
+		}
+		seq_pc += pgm_read_byte(&seq_op_len[op[0]]);
+		switch (op[0]) {
+			case SEQ_OP_TUBES:
+				for (i = 0; i < N_NIXIES; i++) {
+					store_tube(i, op[1+i]);
+				}
+				break;
+			case SEQ_OP_COLOR:
+				for (i = 0; i < N_NIXIES; i++) {
+					store_led(i, &op[1]);
+				}
+				break;
+			case SEQ_OP_LED:
+				if (op[1] < N_NIXIES) {
+					store_led(op[1], &op[2]);
+				}
+				break;
+			case SEQ_OP_HOLD:
+				seq_wait = op[1] | op[2]<<8;
+				break;
+			case SEQ_OP_MARK:
+				seq_mark = seq_pc;
+				break;
+			case SEQ_OP_LOOP:
+				seq_pc = seq_mark;
+				break;
+			case SEQ_OP_END:
+				seq_running = 0;
+				break;
+		}
+	}
+	request_commit();
+}
+#endif
+
 static void set_nixie(uint8_t v) {
-	uint8_t mask = (1<<PB0 | 1<<PB1 | 1<<PB2 | 1<<PB3);
+	BOARD_PORT(BOARD_BCD_PORT) = (BOARD_PORT(BOARD_BCD_PORT) & ~BOARD_BCD_MASK) | pgm_read_byte(&bcd_bits[v & 0x0f]);
+}
+
+static void set_led(uint8_t c[3], uint8_t count) {
 	uint8_t val = 0;
-	if (v & 1<<0) val |= 1<<PB3; // A
-	if (v & 1<<1) val |= 1<<PB1; // B
-	if (v & 1<<2) val |= 1<<PB0; // C
-	if (v & 1<<3) val |= 1<<PB2; // D
+	if (count < c[0]) val |= 1<<BOARD_LED_R;
+	if (count < c[1]) val |= 1<<BOARD_LED_G;
+	if (count < c[2]) val |= 1<<BOARD_LED_B;
 
-	PORTB = (PORTB & ~mask) | val;
+	BOARD_PORT(BOARD_LED_PORT) = (BOARD_PORT(BOARD_LED_PORT) & ~BOARD_LED_MASK) | val;
 }
 
-static void set_led(uint8_t c[3], uint8_t count) {
-	if (count >= c[0])
-		PORTD &= ~(1<<PD4);
-	else
-		PORTD |= 1<<PD4;
-	if (count >= c[1])
-		PORTD &= ~(1<<PD1);
-	else
-		PORTD |= 1<<PD1;
-	if (count >= c[2])
-		PORTD &= ~(1<<PD0);
-	else
-		PORTD |= 1<<PD0;
+#if SUPPORT_ANIMATION
+/* the digit on the lit tube, while crossfading */
+static uint8_t fade_shown;
+
+/* show the old or the new digit during a crossfade, called from the PWM interrupt */
+static void crossfade(uint8_t pwm) {
+	uint8_t v = (pwm < fade_split[m_tube]) ? fade_from[m_tube] : nixie_val[m_tube];
+	if (v == fade_shown) return;
+	fade_shown = v;
+	anode_off(m_tube);
+	set_nixie(v);
+#if SUPPORT_MUX
+	if (!m_on) return;
+#endif
+	anode_on(m_tube);
+}
+#endif
+
+#if SUPPORT_MUX
+/* switch the lit tube on or off, called from the PWM interrupt */
+static void light(uint8_t on) {
+	if (on == m_on) return;
+	m_on = on;
+	if (on) {
+		anode_on(m_tube);
+	} else {
+		anode_off(m_tube);
+	}
+}
+#endif
+
+/* switch to the next tube, called from the PWM interrupt */
+static void next_tube(void) {
+	/* turn the lit tube off before changing the digit */
+	anode_off(m_tube);
+	m_tube = (m_tube < (N_NIXIES-1)) ? m_tube+1 : 0;
+#if SUPPORT_STATS
+	stats.mux_steps++;
+#endif
+	if (m_tube == 0 && commit_pending) commit();
+	set_nixie(nixie_val[m_tube]);
+#if SUPPORT_ANIMATION
+	fade_shown = nixie_val[m_tube];
+#endif
+#if SUPPORT_MUX
+	/* switched on once the blanking is over */
+	m_on = 0;
+#else
+	anode_on(m_tube);
+#endif
 }
 
 #if SUPPORT_ANIMATION
 static uint8_t get_level(uint8_t v) {
 	uint8_t l = sizeof(nixie_level);
-	while (--l && nixie_level[l] != v) {}
+	while (--l && pgm_read_byte(&nixie_level[l]) != v) {}
 	return l;
 }
 
+/* PWM steps of the old digit after pos of FADE_STEPS, eased in and out */
+static uint8_t fade_split_at(uint8_t pos) {
+	uint32_t p = ((uint16_t) pos << 8) / FADE_STEPS;
+	/* smoothstep 3p^2 - 2p^3 in 8.8 fixed point */
+	uint16_t e = (p * p * (3*256 - 2*p)) >> 16;
+	return PWM_STEPS - ((e * PWM_STEPS) >> 8);
+}
+
 static void animate(void) {
 	uint8_t i = 0;
 	uint8_t cl = 0;
 	uint8_t tl = 0;
 	for (i = 0; i<N_NIXIES; i++) {
+		if (animation_style != CUSTOM_RQ_CONST_ANIMATION_CROSSFADE) fade_split[i] = 0;
 		switch (animation_style) {
 			case CUSTOM_RQ_CONST_ANIMATION_STEP:
 				if (nixie_val[i] > nixie_set[i]) {
@@ -134,9 +756,21 @@ static void animate(void) {
 				tl = get_level(nixie_set[i]);
 				if (cl > tl) {
 					/* move down a level */
-					nixie_val[i] = nixie_level[cl-1];
+					nixie_val[i] = pgm_read_byte(&nixie_level[cl-1]);
 				} else if (cl < tl) {
-					nixie_val[i] = nixie_level[cl+1];
+					nixie_val[i] = pgm_read_byte(&nixie_level[cl+1]);
+				}
+				break;
+			case CUSTOM_RQ_CONST_ANIMATION_CROSSFADE:
+				if (nixie_val[i] != nixie_set[i]) {
+					/* fade from whatever is shown, the old digit takes the whole slot first */
+					fade_from[i] = nixie_val[i];
+					fade_split[i] = PWM_STEPS;
+					fade_pos[i] = 0;
+					nixie_val[i] = nixie_set[i];
+				}
+				if (fade_split[i]) {
+					fade_split[i] = fade_split_at(++fade_pos[i]);
 				}
 				break;
 			case CUSTOM_RQ_CONST_ANIMATION_NONE:
@@ -148,37 +782,277 @@ static void animate(void) {
 }
 #endif
 
-void EVENT_USB_Device_ControlRequest(void) {
-	uint8_t buf[8];
+#if SUPPORT_LED_FADE
+/* move the fading LEDs a step closer to their color, called once per tick */
+static void fade_leds(void) {
+	uint16_t pos[3];
+	uint8_t val[3];
+	uint16_t left;
+	uint8_t i, c;
+	for (i = 0; i < N_NIXIES; i++) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			left = led_fade_left[i];
+			memcpy(pos, led_pos[i], sizeof(pos));
+		}
+		if (!left) continue;
+		for (c = 0; c < 3; c++) {
+			/* spread the remaining distance over the ticks left */
+			pos[c] += ((int16_t) (led_target[i][c] << 7) - (int16_t) pos[c]) / (int16_t) left;
+			val[c] = (pos[c] + 64) >> 7;
+		}
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			/* unless a commit changed the LED meanwhile */
+			if (led_fade_left[i] == left) {
+				led_fade_left[i] = left-1;
+				memcpy(led_pos[i], pos, sizeof(pos));
+				memcpy(led_val[i], val, 3);
+				set_duty(i);
+			}
+		}
+	}
+}
+#endif
+
+static void send_info(void) {
+	struct nixie_info info = {
+		.version = NIXIE_PROTOCOL_VERSION,
+		.tubes = N_NIXIES,
+		.features = (SUPPORT_ANIMATION ? NIXIE_FEATURE_ANIMATION : 0) |
+			(SUPPORT_STREAMING ? NIXIE_FEATURE_STREAMING : 0) |
+			(SUPPORT_SEQUENCER ? NIXIE_FEATURE_SEQUENCER : 0) |
+			(SUPPORT_COUNTER ? NIXIE_FEATURE_COUNTER : 0) |
+			(SUPPORT_STATS ? NIXIE_FEATURE_STATS : 0) |
+			(SUPPORT_LED_FADE ? NIXIE_FEATURE_LED_FADE : 0) |
+			NIXIE_FEATURE_CLOCK | NIXIE_FEATURE_SEQUENCE,
+		.features2 = SUPPORT_MUX ? NIXIE_FEATURE2_MUX : 0,
+		.led_pwm_bits = LED_PWM_BITS,
+		.sequence_size = SUPPORT_SEQUENCER ? SEQUENCE_SIZE : 0,
+	};
+	Endpoint_ClearSETUP();
+	Endpoint_Write_Control_Stream_LE(&info, sizeof(info));
+	Endpoint_ClearOUT();
+}
+
+static void send_state(void) {
+	uint8_t state[CUSTOM_RQ_STATE_SIZE(N_NIXIES)];
+	/* the tubes and LEDs change from the main loop and the PWM interrupt */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(&state[0], nixie_val, N_NIXIES);
+#if SUPPORT_ANIMATION
+		memcpy(&state[N_NIXIES], nixie_set, N_NIXIES);
+		state[N_NIXIES*5] = animation_style;
+		state[N_NIXIES*5+1] = animation_speed;
+#else
+		memcpy(&state[N_NIXIES], nixie_val, N_NIXIES);
+		state[N_NIXIES*5] = CUSTOM_RQ_CONST_ANIMATION_NONE;
+		state[N_NIXIES*5+1] = 0;
+#endif
+		memcpy(&state[N_NIXIES*2], led_val, N_NIXIES*3);
+	}
+	Endpoint_ClearSETUP();
+	Endpoint_Write_Control_Stream_LE(state, sizeof(state));
+	Endpoint_ClearOUT();
+}
+
+static void send_clock(void) {
+	struct nixie_clock clock = {
+		.period = TIMER1_TOP+1,
+		.timer_khz = F_CPU/8/1000,
+	};
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		clock.phase = TCNT1;
+		clock.frame = frame;
+		if (TIFR1 & (1<<OCF1A)) {
+			/* the timer wrapped, its interrupt is still to come */
+			clock.phase = TCNT1;
+			clock.frame++;
+		}
+	}
+	Endpoint_ClearSETUP();
+	Endpoint_Write_Control_Stream_LE(&clock, sizeof(clock));
+	Endpoint_ClearOUT();
+}
+
+static void send_ack(void) {
+	struct nixie_ack ack = {
+		.received = received_seq,
+		.applied = applied_seq,
+	};
+	Endpoint_ClearSETUP();
+	Endpoint_Write_Control_Stream_LE(&ack, sizeof(ack));
+	Endpoint_ClearOUT();
+}
+
+#if SUPPORT_STATS
+static void send_stats(void) {
+	struct nixie_stats s;
+	/* the counters change from the main loop and the interrupts */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		s = stats;
+	}
+	s.timer_khz = F_CPU/8/1000;
+	if (USB_ControlRequest.wValue) stats_reset = 1;
+	Endpoint_ClearSETUP();
+	Endpoint_Write_Control_Stream_LE(&s, sizeof(s));
+	Endpoint_ClearOUT();
+}
+#endif
+
+static void receive(uint8_t *data, uint8_t len) {
+	Endpoint_ClearSETUP();
+	Endpoint_Read_Control_Stream_LE(data, len);
+	Endpoint_ClearOUT();
+	while (!(Endpoint_IsINReady()));
+	Endpoint_ClearIN();
+}
+
+static void control_request(void) {
+	uint8_t next = (queue_head+1) & (QUEUE_SIZE-1);
+	uint8_t seq = USB_ControlRequest.wIndex >> 8;
+	uint8_t ahead;
+	/* wLength is checked against QUEUE_DATA before it is narrowed */
+	uint16_t len;
 	if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR | REQREC_DEVICE)) {
 		switch (USB_ControlRequest.bRequest) {
 			case CUSTOM_RQ_SET_NIXIE:
-				Endpoint_ClearSETUP();
-				Endpoint_Read_Control_Stream_LE(&buf, sizeof(buf));
-				Endpoint_ClearOUT();
-				while (!(Endpoint_IsINReady()));
-				Endpoint_ClearIN();
-				process_usb_data(buf, sizeof(buf));
+				/* process_usb_data() ignores packets too short for their command */
+				len = USB_ControlRequest.wLength;
+				if (len > 8) return;
+				break;
+			case CUSTOM_RQ_SET_FRAME:
+#if SUPPORT_SEQUENCER
+			case CUSTOM_RQ_SET_SEQUENCE:
+#endif
+				len = USB_ControlRequest.wLength;
+				break;
+			default:
+				return;
+		}
+		/* requests left unhandled are stalled by LUFA */
+		if (len > QUEUE_DATA) return;
+		if (seq & CUSTOM_RQ_SEQ_FLAG) {
+			ahead = (seq - received_seq) & CUSTOM_RQ_SEQ_MASK;
+			if (ahead == 0 || ahead >= CUSTOM_RQ_SEQ_MASK+1 - CUSTOM_RQ_SEQ_WINDOW) {
+				/* sent again as its answer got lost, the free slot takes the data */
+				receive(queue[queue_head].data, len);
+				return;
+			}
+			/* the ones before it are to come first */
+			if (ahead != 1) return;
+		}
+		if (next == queue_tail) return;
+		queue[queue_head].request = USB_ControlRequest.bRequest;
+		queue[queue_head].len = len;
+		queue[queue_head].value = USB_ControlRequest.wValue;
+		queue[queue_head].index = USB_ControlRequest.wIndex;
+		queue[queue_head].seq = seq;
+		receive(queue[queue_head].data, len);
+		if (seq & CUSTOM_RQ_SEQ_FLAG) received_seq = seq & CUSTOM_RQ_SEQ_MASK;
+		queue_head = next;
+	} else if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE)) {
+		switch (USB_ControlRequest.bRequest) {
+			case CUSTOM_RQ_GET_INFO:
+				send_info();
+				break;
+			case CUSTOM_RQ_GET_STATE:
+				send_state();
+				break;
+			case CUSTOM_RQ_GET_CLOCK:
+				send_clock();
+				break;
+			case CUSTOM_RQ_GET_ACK:
+				send_ack();
+				break;
+#if SUPPORT_STATS
+			case CUSTOM_RQ_GET_STATS:
+				send_stats();
+				break;
+#endif
+		}
+	}
+}
+
+void EVENT_USB_Device_ControlRequest(void) {
+	TIME_START(start);
+	control_request();
+	TIME_END(start, control);
+}
+
+/* apply the control requests received since the last call */
+static void process_queue(void) {
+	while (queue_tail != queue_head) {
+		switch (queue[queue_tail].request) {
+			case CUSTOM_RQ_SET_NIXIE:
+				process_usb_data(queue[queue_tail].data, queue[queue_tail].len);
+				break;
+			case CUSTOM_RQ_SET_FRAME:
+				process_frame(queue[queue_tail].data, queue[queue_tail].len,
+					queue[queue_tail].value >> 8, queue[queue_tail].value & 0xff,
+					queue[queue_tail].index);
+				break;
+#if SUPPORT_SEQUENCER
+			case CUSTOM_RQ_SET_SEQUENCE:
+				store_sequence(queue[queue_tail].data, queue[queue_tail].len,
+					queue[queue_tail].index);
+				break;
+#endif
+		}
+		if (queue[queue_tail].seq & CUSTOM_RQ_SEQ_FLAG) applied_seq = queue[queue_tail].seq & CUSTOM_RQ_SEQ_MASK;
+		queue_tail = (queue_tail+1) & (QUEUE_SIZE-1);
+	}
+}
+
+void EVENT_USB_Device_ConfigurationChanged(void) {
+#if SUPPORT_STREAMING
+	Endpoint_ConfigureEndpoint(NIXIE_STREAM_EPNUM, EP_TYPE_INTERRUPT,
+		ENDPOINT_DIR_OUT, NIXIE_STREAM_EPSIZE, ENDPOINT_BANK_DOUBLE);
+#endif
+}
+
+#if SUPPORT_STREAMING
+/* apply any frames waiting in the stream endpoint, never blocks */
+static void receive_stream(void) {
+	uint8_t packet[NIXIE_STREAM_EPSIZE];
+	uint8_t len;
+	uint8_t i;
+	if (USB_DeviceState != DEVICE_STATE_Configured) return;
+	Endpoint_SelectEndpoint(NIXIE_STREAM_EPNUM);
+	while (Endpoint_IsOUTReceived()) {
+		len = Endpoint_BytesInEndpoint();
+		if (len > sizeof(packet)) len = sizeof(packet);
+		for (i = 0; i < len; i++) {
+			packet[i] = Endpoint_Read_8();
+		}
+		Endpoint_ClearOUT();
+		if (len >= 2) {
+			process_frame(&packet[2], len-2, 0, packet[0], packet[1]);
 		}
 	}
 }
+#endif
 
 int main(void) {
-	DDRB = (
-		/* BCD */
-		1<<PB0 | 1<<PB1 | 1<<PB2 | 1<<PB3 |
-		/* Multiplexing */
-		1<<PB7 | 1<<PB6 | 1<<PB5
-	);
-	DDRD = (
-		/* LED */
-		1<<PD4 | 1<<PD1 | 1<<PD0
-	);
+	/* all tubes off until the first multiplex step */
+#define ANODE(p, b) BOARD_PORT(p) |= 1<<(b); BOARD_DDR(p) |= 1<<(b);
+	BOARD_ANODES(ANODE)
+#undef ANODE
+	BOARD_DDR(BOARD_BCD_PORT) |= BOARD_BCD_MASK;
+	BOARD_DDR(BOARD_LED_PORT) |= BOARD_LED_MASK;
 	clock_prescale_set(clock_div_1);
 
+#if SUPPORT_MUX
+	set_brightness(CUSTOM_RQ_TUBE_ALL, 100);
+#endif
+
+	/* configure timer 0 for LED PWM and multiplexing */
+	TCCR0A = ( 1<<WGM01 );
+	TCCR0B = ( 1<<CS01 | 1<<CS00 );
+	OCR0A = PWM_OCR;
+	TIMSK0 = (1 << OCIE0A);
+
 	/* configure timer for 200 Hz */
 	TCCR1B = ( 1<<WGM12 | 1<<CS11 );
-	OCR1A = 0x2710;
+	OCR1A = TIMER1_TOP;
 	TIMSK1 = (1 << OCIE1A);
 
 	wdt_enable(WDTO_1S);
@@ -189,57 +1063,88 @@ int main(void) {
 
 	sei();
 
-	uint8_t m_tube = 0;
 	while(1) {
-		if (time_passed) {
-#if N_NIXIES == 2
-			m_tube = 1-m_tube;
-
-			if (m_tube == 0) {
-				PORTB |= 1<<PB6;
-				set_nixie(nixie_val[m_tube]);
-				PORTB &= ~(1<<PB7);
-			} else {
-				set_nixie(nixie_val[m_tube]);
-				PORTB &= ~(1<<PB6);
-			}
-			time_passed = 0;
-#elif N_NIXIES == 3
-			m_tube = (m_tube < (N_NIXIES-1)) ? m_tube+1 : 0;
-			PORTB |= (1<<PB7 | 1<<PB6 | 1<<PB5);
-			set_nixie(nixie_val[m_tube]);
-			switch(m_tube) {
-				case 0:
-					PORTB &= ~(1<<PB7);
-					break;
-				case 1:
-					PORTB &= ~(1<<PB6);
-					break;
-				case 2:
-					PORTB &= ~(1<<PB5);
-					break;
+		TIME_START(loop_start);
+		wdt_reset();
+#if SUPPORT_STATS
+		if (stats_reset) {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				memset(&stats, 0, sizeof(stats));
 			}
-			time_passed = 0;
-#else
-		/* add some generic multiplexing code here... */
-#endif
+			stats_reset = 0;
 		}
-		set_led(led_val[m_tube], led_pwm[m_tube]);
-		led_pwm[m_tube] = (led_pwm[m_tube] == UINT8_MAX) ? 0 : led_pwm[m_tube]+1;
-
-		wdt_reset();
+#endif
+		TIME_START(usb_start);
 		USB_USBTask();
+		TIME_END(usb_start, usb_task);
+		process_queue();
+#if SUPPORT_STREAMING
+		receive_stream();
+#endif
 
 #if SUPPORT_ANIMATION
 		if (animation_step) {
+			TIME_START(anim_start);
 			animate();
+			TIME_END(anim_start, animate);
 			animation_step = 0;
 		}
 #endif
+		if (tick) {
+			tick = 0;
+#if SUPPORT_STATS
+			/* the timer restarted at the tick */
+			account(&stats.tick_delay, 0);
+#endif
+#if SUPPORT_SEQUENCER
+			run_sequence();
+#endif
+#if SUPPORT_COUNTER
+			run_counter();
+#endif
+#if SUPPORT_LED_FADE
+			fade_leds();
+#endif
+			if (commit_at) {
+				uint32_t f;
+				ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+					f = frame;
+				}
+				if ((int32_t) (f - commit_frame) >= 0) {
+					commit_at = 0;
+					hold = 0;
+					request_commit();
+				}
+			}
+		}
+		TIME_END(loop_start, loop);
 	}
 	return 0;
 }
 
+ISR(TIMER0_COMPA_vect) {
+	static uint8_t pwm = PWM_STEPS-1;
+	static uint8_t period = MUX_PWM_PERIODS-1;
+#if SUPPORT_MUX
+	uint16_t step;
+#endif
+	if (++pwm == PWM_STEPS) {
+		pwm = 0;
+		if (++period == MUX_PWM_PERIODS) {
+			period = 0;
+			next_tube();
+		}
+	}
+#if SUPPORT_MUX
+	step = period * PWM_STEPS + pwm;
+	light(step >= mux_blank && step < SLOT_STEPS - mux_dim[m_tube]);
+#endif
+#if SUPPORT_ANIMATION
+	if (fade_split[m_tube]) crossfade(pwm);
+#endif
+	set_led(led_duty[m_tube], pwm);
+}
+
 ISR(TIMER1_COMPA_vect) {
 #if SUPPORT_ANIMATION
 	static uint8_t count = 0;
@@ -248,5 +1153,10 @@ ISR(TIMER1_COMPA_vect) {
 		count = 0;
 	}
 #endif
-	time_passed = 1;
+#if SUPPORT_STATS
+	stats.ticks++;
+	if (tick) stats.missed_ticks++;
+#endif
+	tick = 1;
+	frame++;
 }
@@ -6,9 +6,14 @@
 #ifndef __REQUESTS_H_INCLUDED__
 #define __REQUESTS_H_INCLUDED__
 
+#include <stdint.h>
+
 #define USB_VID 0x16c0
 #define USB_PID 0x05dc
 
+/* the largest number of tubes a single device drives */
+#define NIXIE_MAX_TUBES 8
+
 #define CUSTOM_RQ_SET_NIXIE 3
 #define CUSTOM_RQ_CONST_TUBE 0
 #define CUSTOM_RQ_CONST_LED 1
@@ -19,5 +24,207 @@
 #define CUSTOM_RQ_CONST_ANIMATION_STEP 1
 #define CUSTOM_RQ_CONST_ANIMATION_LEVEL 2
 #define CUSTOM_RQ_CONST_ANIMATION_LEVEL_SEQ 3
+/* the old digit fades into the new one, the multiplex slot of a tube is
+ * split between both */
+#define CUSTOM_RQ_CONST_ANIMATION_CROSSFADE 4
+
+/* Updates are collected in a back buffer that is shown from the start of
+ * the next multiplex cycle on. After CUSTOM_RQ_CONST_HOLD, updates only
+ * accumulate until CUSTOM_RQ_CONST_COMMIT (or a frame carrying
+ * CUSTOM_RQ_FRAME_COMMIT) shows all of them at once.
+ */
+#define CUSTOM_RQ_CONST_HOLD 5
+#define CUSTOM_RQ_CONST_COMMIT 6
+
+/* Set a whole display frame with a single transfer: the low byte of
+ * wValue holds the number of tubes in the frame, the high byte the first
+ * tube it applies to. wIndex selects the sections contained in the data
+ * stage (in this order):
+ * - one digit per tube
+ * - three LED values (r/g/b) per tube
+ * - animation style and speed
+ */
+#define CUSTOM_RQ_SET_FRAME 4
+#define CUSTOM_RQ_FRAME_TUBES (1<<0)
+#define CUSTOM_RQ_FRAME_LEDS (1<<1)
+#define CUSTOM_RQ_FRAME_ANIMATION (1<<2)
+#define CUSTOM_RQ_FRAME_COMMIT (1<<3)
+
+#define CUSTOM_RQ_FRAME_SIZE(n) ((n)*4 + 2)
+
+/* Device to host request describing the device, answered with a struct
+ * nixie_info (shorter if wLength asks for less).
+ */
+#define CUSTOM_RQ_GET_INFO 5
+#define NIXIE_PROTOCOL_VERSION 1
+#define NIXIE_FEATURE_ANIMATION (1<<0)
+#define NIXIE_FEATURE_STREAMING (1<<1)
+#define NIXIE_FEATURE_SEQUENCER (1<<2)
+#define NIXIE_FEATURE_COUNTER (1<<3)
+
+struct nixie_info {
+	uint8_t version;
+	uint8_t tubes;
+	uint8_t features;
+	uint8_t led_pwm_bits;
+	uint8_t sequence_size;
+	/* NIXIE_FEATURE2_ flags, 0 from older firmware */
+	uint8_t features2;
+};
+
+/* Device to host request returning a snapshot of the display:
+ * - the digit currently shown on each tube
+ * - the digit each tube is set to (and animates towards)
+ * - three LED values (r/g/b) per tube
+ * - animation style and speed
+ */
+#define CUSTOM_RQ_GET_STATE 6
+#define CUSTOM_RQ_STATE_SIZE(n) ((n)*5 + 2)
+
+/* Upload (part of) a program for the sequencer, wIndex holds the offset
+ * of the data within the program, at most CUSTOM_RQ_SEQUENCE_CHUNK bytes
+ * are sent at once. Uploading (or setting a tube) stops the sequencer,
+ * a CUSTOM_RQ_SET_NIXIE packet [CUSTOM_RQ_CONST_SEQUENCE, 1] starts the
+ * program from its beginning, [CUSTOM_RQ_CONST_SEQUENCE, 0] stops it.
+ * Each step of the program starts with one of the opcodes below:
+ * - SEQ_OP_END: stop the sequencer
+ * - SEQ_OP_TUBES, one digit per tube: set all tubes
+ * - SEQ_OP_COLOR, r, g, b: set all LEDs
+ * - SEQ_OP_LED, tube, r, g, b: set a single LED
+ * - SEQ_OP_HOLD, low, high: show the display for that many ticks of 5ms
+ * - SEQ_OP_MARK: remember the position to loop back to
+ * - SEQ_OP_LOOP: continue at the last mark (or the beginning)
+ */
+#define CUSTOM_RQ_SET_SEQUENCE 7
+#define CUSTOM_RQ_SEQUENCE_CHUNK 8
+#define CUSTOM_RQ_CONST_SEQUENCE 7
+
+#define SEQ_OP_END 0
+#define SEQ_OP_TUBES 1
+#define SEQ_OP_COLOR 2
+#define SEQ_OP_LED 3
+#define SEQ_OP_HOLD 4
+#define SEQ_OP_MARK 5
+#define SEQ_OP_LOOP 6
+
+/* Let the device count on its own: a CUSTOM_RQ_SET_NIXIE packet
+ * [CUSTOM_RQ_CONST_COUNTER, flags, value (4 bytes), period (2 bytes)],
+ * multi byte values in little endian order, shows the value and steps it
+ * every period ticks of 5ms. A period of 0 (or setting a tube) stops the
+ * counter. With COUNTER_CLOCK, the value counts seconds and is shown as
+ * hours, minutes and seconds (two tubes each, from the last tube on).
+ */
+#define CUSTOM_RQ_CONST_COUNTER 8
+#define CUSTOM_RQ_COUNTER_DOWN (1<<0)
+#define CUSTOM_RQ_COUNTER_LEADING_ZERO (1<<1)
+#define CUSTOM_RQ_COUNTER_CLOCK (1<<2)
+
+/* Device to host request returning a struct nixie_stats with the
+ * firmware's counters since they were last reset, wValue 1 resets them
+ * once read. Durations are counted in cycles of a timer running at
+ * timer_khz kHz, values are little endian.
+ */
+#define CUSTOM_RQ_GET_STATS 8
+#define NIXIE_FEATURE_STATS (1<<4)
+
+struct nixie_timing {
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint32_t count;
+} __attribute__((packed));
+
+struct nixie_stats {
+	uint16_t timer_khz;
+	/* multiplex steps and 5ms ticks, ticks still pending when the next came */
+	uint32_t mux_steps;
+	uint32_t ticks;
+	uint32_t missed_ticks;
+	/* from the tick until the main loop gets to it */
+	struct nixie_timing tick_delay;
+	/* a main loop iteration and the work done within */
+	struct nixie_timing loop;
+	struct nixie_timing animate;
+	struct nixie_timing usb_task;
+	/* the control request handler, called from the USB interrupt */
+	struct nixie_timing control;
+} __attribute__((packed));
+
+/* Fade LEDs on the device: a CUSTOM_RQ_SET_NIXIE packet
+ * [CUSTOM_RQ_CONST_LED_FADE, tube, r, g, b, ticks (2 bytes)] moves the LED
+ * of the tube (all of them for CUSTOM_RQ_LED_ALL) from its color to r/g/b
+ * within that many ticks of 5ms, starting when the update is committed.
+ */
+#define CUSTOM_RQ_CONST_LED_FADE 9
+#define CUSTOM_RQ_LED_ALL 0xff
+#define NIXIE_FEATURE_LED_FADE (1<<5)
+
+/* Device to host request returning a struct nixie_clock: the frame, a
+ * free running count of the 5ms ticks the display is driven by, and how
+ * far into it the device is, counted up to period by a timer running at
+ * timer_khz kHz. A CUSTOM_RQ_SET_NIXIE packet
+ * [CUSTOM_RQ_CONST_COMMIT_AT, 0, frame (4 bytes)] holds the updates
+ * received so far and shows them from the first multiplex cycle at or
+ * after that frame on, values are little endian.
+ */
+#define CUSTOM_RQ_GET_CLOCK 9
+#define CUSTOM_RQ_CONST_COMMIT_AT 10
+#define NIXIE_FEATURE_CLOCK (1<<6)
+
+struct nixie_clock {
+	uint32_t frame;
+	uint16_t phase;
+	uint16_t period;
+	uint16_t timer_khz;
+} __attribute__((packed));
+
+/* Requests to the device are numbered if it reports NIXIE_FEATURE_SEQUENCE:
+ * the high byte of wIndex holds CUSTOM_RQ_SEQ_FLAG and a 7 bit number
+ * counting up by one per request. The device acknowledges a request it
+ * already received without applying it again and stalls one that skips
+ * a number, so the host sends the missing ones first. Requests without
+ * the flag are applied as they come. The device to host request
+ * CUSTOM_RQ_GET_ACK returns a struct nixie_ack with the numbers of the
+ * last request received and of the last one applied.
+ */
+#define CUSTOM_RQ_SEQ_FLAG 0x80
+#define CUSTOM_RQ_SEQ_MASK 0x7f
+/* numbers up to this far behind the last one received are repeats */
+#define CUSTOM_RQ_SEQ_WINDOW 64
+#define CUSTOM_RQ_GET_ACK 10
+#define NIXIE_FEATURE_SEQUENCE (1<<7)
+
+struct nixie_ack {
+	uint8_t received;
+	uint8_t applied;
+};
+
+/* Set the multiplexing at run time, if the device reports
+ * NIXIE_FEATURE2_MUX: a CUSTOM_RQ_SET_NIXIE packet
+ * [CUSTOM_RQ_CONST_MUX, 0, rate (2 bytes), blank (2 bytes)] lights each
+ * tube about rate times per second (0 for the default) and keeps all
+ * tubes off for the first blank microseconds of a slot while the digit
+ * changes. [CUSTOM_RQ_CONST_BRIGHTNESS, tube, percent] lights the tube
+ * (all of them for CUSTOM_RQ_TUBE_ALL) for that much of the rest of its
+ * slot. Both apply right away, values are little endian.
+ */
+#define CUSTOM_RQ_CONST_MUX 11
+#define CUSTOM_RQ_CONST_BRIGHTNESS 12
+#define CUSTOM_RQ_TUBE_ALL 0xff
+#define NIXIE_FEATURE2_MUX (1<<0)
+
+/* A CUSTOM_RQ_SET_NIXIE packet starting with CUSTOM_RQ_CONST_NOP changes
+ * nothing, like any command the firmware does not know. It is queued and
+ * numbered like the others, for measuring the way to the board.
+ */
+#define CUSTOM_RQ_CONST_NOP 13
+
+/* Frames can also be streamed to the (optional) interrupt OUT endpoint:
+ * each packet starts with the tube count and the section flags, followed
+ * by the data laid out as for CUSTOM_RQ_SET_FRAME. A packet holds a full
+ * frame of NIXIE_MAX_TUBES.
+ */
+#define NIXIE_STREAM_EPNUM 1
+#define NIXIE_STREAM_EPSIZE 64
 
 #endif /* __REQUESTS_H_INCLUDED__ */
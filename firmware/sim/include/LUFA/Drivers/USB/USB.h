@@ -0,0 +1,78 @@
+/* The parts of the LUFA device API used by the firmware, backed by
+ * the scripted host of sim.c
+ */
+
+#ifndef __SIM_LUFA_USB_H__
+#define __SIM_LUFA_USB_H__
+
+#include <stdint.h>
+
+#define ATTR_WARN_UNUSED_RESULT
+#define ATTR_NON_NULL_PTR_ARG(...)
+
+typedef struct {
+	uint8_t  bmRequestType;
+	uint8_t  bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} USB_Request_Header_t;
+
+extern USB_Request_Header_t USB_ControlRequest;
+
+#define REQDIR_HOSTTODEVICE (0 << 7)
+#define REQDIR_DEVICETOHOST (1 << 7)
+#define REQTYPE_STANDARD (0 << 5)
+#define REQTYPE_CLASS (1 << 5)
+#define REQTYPE_VENDOR (2 << 5)
+#define REQREC_DEVICE (0 << 0)
+#define REQREC_INTERFACE (1 << 0)
+
+enum USB_Device_States_t {
+	DEVICE_STATE_Unattached,
+	DEVICE_STATE_Powered,
+	DEVICE_STATE_Default,
+	DEVICE_STATE_Addressed,
+	DEVICE_STATE_Configured,
+	DEVICE_STATE_Suspended,
+};
+
+extern volatile uint8_t USB_DeviceState;
+
+/* descriptor types, only needed to parse Descriptors.h */
+typedef struct { uint8_t Size; uint8_t Type; } USB_Descriptor_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Configuration_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Interface_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Endpoint_t;
+
+#define ENDPOINT_CONTROLEP 0
+#define EP_TYPE_CONTROL 0
+#define EP_TYPE_ISOCHRONOUS 1
+#define EP_TYPE_BULK 2
+#define EP_TYPE_INTERRUPT 3
+#define ENDPOINT_DIR_OUT 0
+#define ENDPOINT_DIR_IN 1
+#define ENDPOINT_BANK_SINGLE 0
+#define ENDPOINT_BANK_DOUBLE 1
+
+void USB_Init(void);
+void USB_USBTask(void);
+
+uint8_t Endpoint_ConfigureEndpoint(uint8_t number, uint8_t type, uint8_t direction, uint16_t size, uint8_t banks);
+void Endpoint_SelectEndpoint(uint8_t number);
+uint8_t Endpoint_GetCurrentEndpoint(void);
+
+void Endpoint_ClearSETUP(void);
+void Endpoint_ClearIN(void);
+void Endpoint_ClearOUT(void);
+void Endpoint_ClearStatusStage(void);
+void Endpoint_StallTransaction(void);
+uint8_t Endpoint_IsINReady(void);
+uint8_t Endpoint_IsOUTReceived(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+uint8_t Endpoint_Read_8(void);
+
+uint8_t Endpoint_Read_Control_Stream_LE(void *buffer, uint16_t length);
+uint8_t Endpoint_Write_Control_Stream_LE(const void *buffer, uint16_t length);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef __SIM_LUFA_VERSION_H__
+#define __SIM_LUFA_VERSION_H__
+
+#define LUFA_VERSION_STRING "sim"
+
+#endif
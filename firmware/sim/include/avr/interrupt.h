@@ -0,0 +1,14 @@
+/* Interrupts of the simulated MCU, see sim.c */
+
+#ifndef __SIM_AVR_INTERRUPT_H__
+#define __SIM_AVR_INTERRUPT_H__
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+void sim_sei(void);
+void sim_cli(void);
+
+#define sei() sim_sei()
+#define cli() sim_cli()
+
+#endif
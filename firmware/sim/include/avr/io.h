@@ -0,0 +1,62 @@
+/* Simulated I/O registers, see sim.c */
+
+#ifndef __SIM_AVR_IO_H__
+#define __SIM_AVR_IO_H__
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTB, DDRB;
+extern volatile uint8_t PORTC, DDRC;
+extern volatile uint8_t PORTD, DDRD;
+
+extern volatile uint8_t TCCR0A, TCCR0B, TIMSK0, OCR0A, OCR0B, TCNT0;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t OCR1A, OCR1B, TCNT1;
+/* never set, interrupts fire as soon as they are due */
+extern volatile uint8_t TIFR1;
+#define OCF1A 1
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PC7 7
+
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+/* timer 0 */
+#define WGM00 0
+#define WGM01 1
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define OCIE0A 1
+#define OCIE0B 2
+
+/* timer 1 */
+#define WGM12 3
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define OCIE1A 1
+#define OCIE1B 2
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef __SIM_AVR_PGMSPACE_H__
+#define __SIM_AVR_PGMSPACE_H__
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+#define pgm_read_word(p) (*(const uint16_t *) (p))
+#define pgm_read_ptr(p) (*(void * const *) (p))
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef __SIM_AVR_POWER_H__
+#define __SIM_AVR_POWER_H__
+
+#define clock_div_1 0
+#define clock_prescale_set(x) ((void) (x))
+
+#endif
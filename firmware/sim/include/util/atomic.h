@@ -0,0 +1,9 @@
+#ifndef __SIM_UTIL_ATOMIC_H__
+#define __SIM_UTIL_ATOMIC_H__
+
+/* simulated interrupts only fire between main loop iterations */
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+#define ATOMIC_BLOCK(type) for (int __sim_atomic = 1; __sim_atomic; __sim_atomic = 0)
+
+#endif
@@ -0,0 +1,498 @@
+/*
+ * sim.c
+ *
+ * Runs nixie-usb.c on the build host: the registers, timers, watchdog
+ * and LUFA calls used by the firmware are backed by this file and advance
+ * a virtual clock of F_CPU cycles. Every iteration of the firmware main
+ * loop (one call to USB_USBTask()) costs a fixed number of cycles, timer
+ * interrupts fire at their exact virtual time in between.
+ *
+ * The host side is played from a script, one event per line:
+ *
+ *   <ms> out <bRequest> <wValue> <wIndex> [data bytes...]
+ *   <ms> in <bRequest> <wValue> <wIndex> <wLength>
+ *   <ms> stream [packet bytes...]
+ *   <ms> end
+ *
+ * Numbers may be given in decimal or as 0x.. hex, '#' starts a comment.
+ * At the end, the on-time, shown digits and LED duty cycles of every
+ * tube are reported, -v also lists every transition a tube shows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <LUFA/Drivers/USB/USB.h>
+
+#include "requests.h"
+#include "board.h"
+
+#define N_TUBES N_NIXIES
+#define MAX_EVENTS 4096
+#define MAX_DATA 64
+
+/* pin mapping of the board, as driven by nixie-usb.c */
+static volatile uint8_t *const anode_port[N_TUBES] = {
+#define ANODE(p, b) &BOARD_PORT(p),
+	BOARD_ANODES(ANODE)
+#undef ANODE
+};
+static volatile uint8_t *const anode_ddr[N_TUBES] = {
+#define ANODE(p, b) &BOARD_DDR(p),
+	BOARD_ANODES(ANODE)
+#undef ANODE
+};
+static const uint8_t anode_pin[N_TUBES] = {
+#define ANODE(p, b) b,
+	BOARD_ANODES(ANODE)
+#undef ANODE
+};
+static const uint8_t led_pin[3] = { BOARD_LED_R, BOARD_LED_G, BOARD_LED_B };
+
+volatile uint8_t PORTB, DDRB;
+volatile uint8_t PORTC, DDRC;
+volatile uint8_t PORTD, DDRD;
+volatile uint8_t TCCR0A, TCCR0B, TIMSK0, OCR0A, OCR0B, TCNT0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t OCR1A, OCR1B, TCNT1;
+volatile uint8_t TIFR1;
+
+USB_Request_Header_t USB_ControlRequest;
+volatile uint8_t USB_DeviceState = DEVICE_STATE_Unattached;
+
+/* provided by the firmware (main() is renamed when building the simulator) */
+int firmware_main(void);
+void EVENT_USB_Device_ControlRequest(void);
+void EVENT_USB_Device_ConfigurationChanged(void) __attribute__((weak));
+void TIMER0_COMPA_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+
+enum event_type { EV_OUT, EV_IN, EV_STREAM, EV_END };
+
+struct event {
+	uint64_t at;
+	enum event_type type;
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+	uint8_t data[MAX_DATA];
+};
+
+/* with room for the end appended to scripts that lack one */
+static struct event events[MAX_EVENTS+1];
+static int n_events = 0;
+static int next_event = 0;
+
+/* virtual time in CPU cycles */
+static uint64_t now = 0;
+static uint64_t last_account = 0;
+static uint32_t loop_cycles = 400;
+static uint8_t verbose = 0;
+static uint8_t interrupts = 0;
+
+static uint64_t loops = 0;
+static uint64_t t0_next = 0;
+static uint64_t t1_next = 0;
+static uint64_t t1_last = 0;
+static uint64_t t0_count = 0;
+static uint64_t t1_count = 0;
+
+static uint64_t wdt_timeout = 0;
+static uint64_t wdt_last = 0;
+
+/* what the tubes actually showed */
+static uint64_t tube_on[N_TUBES];
+static uint64_t digit_on[N_TUBES][16];
+static uint64_t led_on[N_TUBES][3];
+static uint64_t overlap = 0;
+static int shown[N_TUBES];
+static uint64_t transitions[N_TUBES];
+
+/* the control transfer currently being handled */
+static struct event *control = NULL;
+static uint8_t control_handled = 0;
+static uint8_t control_stalled = 0;
+
+/* stream endpoint */
+static uint8_t selected_ep = 0;
+static uint16_t stream_size = 0;
+static struct event *stream_packet = NULL;
+static uint16_t stream_pos = 0;
+
+static double ms(uint64_t cycles) {
+	return cycles * 1000.0 / F_CPU;
+}
+
+static uint64_t cycles(double ms) {
+	return (uint64_t) (ms * F_CPU / 1000.0);
+}
+
+static void fail(const char *msg) {
+	fprintf(stderr, "%10.3f ms: %s\n", ms(now), msg);
+	exit(1);
+}
+
+static uint32_t prescaler(uint8_t cs) {
+	static const uint32_t div[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	return div[cs & 0x07];
+}
+
+static uint64_t timer0_period(void) {
+	uint32_t p = prescaler(TCCR0B);
+	return (p && (TIMSK0 & 1<<OCIE0A)) ? (uint64_t) (OCR0A+1) * p : 0;
+}
+
+static uint64_t timer1_period(void) {
+	uint32_t p = prescaler(TCCR1B);
+	return (p && (TIMSK1 & 1<<OCIE1A)) ? (uint64_t) (OCR1A+1) * p : 0;
+}
+
+static int decode_bcd(uint8_t port) {
+	int v = 0;
+	if (port & 1<<BOARD_BCD_A) v |= 1<<0;
+	if (port & 1<<BOARD_BCD_B) v |= 1<<1;
+	if (port & 1<<BOARD_BCD_C) v |= 1<<2;
+	if (port & 1<<BOARD_BCD_D) v |= 1<<3;
+	return v;
+}
+
+/* attribute the time since the last call to the current port state */
+static void account(void) {
+	uint64_t dt = now - last_account;
+	int lit = -1;
+	int n_lit = 0;
+	int i, c;
+	last_account = now;
+	for (i = 0; i < N_TUBES; i++) {
+		/* anodes are switched on by pulling them low */
+		if ((*anode_ddr[i] & 1<<anode_pin[i]) && !(*anode_port[i] & 1<<anode_pin[i])) {
+			lit = i;
+			n_lit++;
+		}
+	}
+	if (n_lit > 1) {
+		overlap += dt;
+		return;
+	}
+	if (lit < 0) return;
+
+	int digit = decode_bcd(BOARD_PORT(BOARD_BCD_PORT));
+	tube_on[lit] += dt;
+	digit_on[lit][digit] += dt;
+	for (c = 0; c < 3; c++) {
+		if (BOARD_PORT(BOARD_LED_PORT) & 1<<led_pin[c]) led_on[lit][c] += dt;
+	}
+	if (digit != shown[lit]) {
+		if (verbose) {
+			printf("%10.3f ms tube %d: ", ms(now), lit);
+			if (shown[lit] < 0 || shown[lit] > 9) printf("off"); else printf("%d", shown[lit]);
+			if (digit > 9) printf(" -> off\n"); else printf(" -> %d\n", digit);
+		}
+		shown[lit] = digit;
+		transitions[lit]++;
+	}
+}
+
+static void report(void) {
+	int i, d;
+	account();
+	printf("simulated %.3f ms: %llu main loop iterations, %llu timer0 and %llu timer1 interrupts\n",
+		ms(now), (unsigned long long) loops,
+		(unsigned long long) t0_count, (unsigned long long) t1_count);
+	if (overlap) {
+		printf("more than one tube lit for %.3f ms\n", ms(overlap));
+	}
+	printf("tube  on-time  led r/g/b duty     transitions  digits shown (%% of on-time)\n");
+	for (i = 0; i < N_TUBES; i++) {
+		double on = tube_on[i] ? (double) tube_on[i] : 1;
+		printf("%4d  %6.2f%%  %5.1f/%5.1f/%5.1f%%  %11llu ",
+			i, 100.0 * tube_on[i] / (now ? now : 1),
+			100.0 * led_on[i][0] / on, 100.0 * led_on[i][1] / on, 100.0 * led_on[i][2] / on,
+			(unsigned long long) transitions[i]);
+		for (d = 0; d < 16; d++) {
+			if (!digit_on[i][d]) continue;
+			if (d > 9) {
+				printf(" off:%.1f", 100.0 * digit_on[i][d] / on);
+			} else {
+				printf(" %d:%.1f", d, 100.0 * digit_on[i][d] / on);
+			}
+		}
+		printf("\n");
+	}
+}
+
+static void run_control(struct event *e) {
+	control = e;
+	control_handled = 0;
+	control_stalled = 0;
+	USB_ControlRequest.bmRequestType = (e->type == EV_IN ? REQDIR_DEVICETOHOST : REQDIR_HOSTTODEVICE) | REQTYPE_VENDOR | REQREC_DEVICE;
+	USB_ControlRequest.bRequest = e->request;
+	USB_ControlRequest.wValue = e->value;
+	USB_ControlRequest.wIndex = e->index;
+	USB_ControlRequest.wLength = e->length;
+	EVENT_USB_Device_ControlRequest();
+	if (!control_handled || control_stalled) {
+		printf("%10.3f ms request %u stalled\n", ms(now), e->request);
+	}
+	control = NULL;
+}
+
+static void run_events(void) {
+	while (next_event < n_events && events[next_event].at <= now) {
+		struct event *e = &events[next_event++];
+		switch (e->type) {
+			case EV_OUT:
+			case EV_IN:
+				run_control(e);
+				break;
+			case EV_STREAM:
+				if (stream_packet) {
+					printf("%10.3f ms stream packet dropped, endpoint busy\n", ms(now));
+				} else if (e->length > stream_size) {
+					printf("%10.3f ms stream packet exceeds endpoint size\n", ms(now));
+				} else {
+					stream_packet = e;
+					stream_pos = 0;
+				}
+				break;
+			case EV_END:
+				report();
+				exit(0);
+		}
+	}
+}
+
+/* advance the virtual clock, firing every interrupt due on the way */
+static void advance(uint64_t until) {
+	while (1) {
+		uint64_t p0 = timer0_period();
+		uint64_t p1 = timer1_period();
+		uint64_t next = until;
+		if (!p0) t0_next = 0; else if (!t0_next) t0_next = now + p0;
+		if (!p1) t1_next = 0; else if (!t1_next) { t1_last = now; t1_next = now + p1; }
+		if (interrupts && t0_next && t0_next < next) next = t0_next;
+		if (interrupts && t1_next && t1_next < next) next = t1_next;
+		if (next >= until) break;
+		now = next;
+		account();
+		if (next == t0_next) {
+			t0_next += p0;
+			t0_count++;
+			if (TIMER0_COMPA_vect) TIMER0_COMPA_vect();
+		} else {
+			t1_last = t1_next;
+			t1_next += p1;
+			t1_count++;
+			TCNT1 = 0;
+			if (TIMER1_COMPA_vect) TIMER1_COMPA_vect();
+		}
+		account();
+	}
+	now = until;
+	account();
+	if (t1_next) {
+		TCNT1 = (uint16_t) ((now - t1_last) / prescaler(TCCR1B));
+	}
+	if (wdt_timeout && now - wdt_last > wdt_timeout) {
+		fail("watchdog reset, main loop stalled");
+	}
+}
+
+void sim_sei(void) {
+	interrupts = 1;
+}
+
+void sim_cli(void) {
+	interrupts = 0;
+}
+
+void sim_delay_us(double us) {
+	advance(now + (uint64_t) (us * F_CPU / 1e6));
+}
+
+void sim_wdt_enable(unsigned char timeout) {
+	wdt_timeout = cycles(15 << timeout);
+	wdt_last = now;
+}
+
+void sim_wdt_reset(void) {
+	wdt_last = now;
+}
+
+void USB_Init(void) {
+	USB_DeviceState = DEVICE_STATE_Powered;
+}
+
+void USB_USBTask(void) {
+	if (USB_DeviceState != DEVICE_STATE_Configured) {
+		USB_DeviceState = DEVICE_STATE_Configured;
+		if (EVENT_USB_Device_ConfigurationChanged) EVENT_USB_Device_ConfigurationChanged();
+	}
+	loops++;
+	run_events();
+	advance(now + loop_cycles);
+}
+
+uint8_t Endpoint_ConfigureEndpoint(uint8_t number, uint8_t type, uint8_t direction, uint16_t size, uint8_t banks) {
+	if (number == NIXIE_STREAM_EPNUM && direction == ENDPOINT_DIR_OUT) {
+		stream_size = size;
+	}
+	return 1;
+}
+
+void Endpoint_SelectEndpoint(uint8_t number) {
+	selected_ep = number;
+}
+
+uint8_t Endpoint_GetCurrentEndpoint(void) {
+	return selected_ep;
+}
+
+void Endpoint_ClearSETUP(void) {
+	control_handled = 1;
+}
+
+void Endpoint_ClearIN(void) {
+}
+
+void Endpoint_ClearStatusStage(void) {
+}
+
+void Endpoint_StallTransaction(void) {
+	control_stalled = 1;
+}
+
+uint8_t Endpoint_IsINReady(void) {
+	return 1;
+}
+
+uint8_t Endpoint_IsOUTReceived(void) {
+	return selected_ep == NIXIE_STREAM_EPNUM && stream_packet != NULL;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void) {
+	return (selected_ep == NIXIE_STREAM_EPNUM && stream_packet) ? stream_packet->length - stream_pos : 0;
+}
+
+uint8_t Endpoint_Read_8(void) {
+	if (selected_ep != NIXIE_STREAM_EPNUM || !stream_packet || stream_pos >= stream_packet->length) return 0;
+	return stream_packet->data[stream_pos++];
+}
+
+void Endpoint_ClearOUT(void) {
+	if (selected_ep == NIXIE_STREAM_EPNUM) {
+		stream_packet = NULL;
+	}
+}
+
+uint8_t Endpoint_Read_Control_Stream_LE(void *buffer, uint16_t length) {
+	if (!control) fail("control data read outside of a request");
+	if (length > control->length) length = control->length;
+	memcpy(buffer, control->data, length);
+	return 0;
+}
+
+uint8_t Endpoint_Write_Control_Stream_LE(const void *buffer, uint16_t length) {
+	const uint8_t *b = buffer;
+	uint16_t i;
+	if (!control) fail("control data written outside of a request");
+	if (length > control->length) length = control->length;
+	printf("%10.3f ms request %u returned", ms(now), control->request);
+	for (i = 0; i < length; i++) {
+		printf(" %02x", b[i]);
+	}
+	printf("\n");
+	return 0;
+}
+
+static void load_script(FILE *f) {
+	char line[1024];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		struct event *e = &events[n_events];
+		char *p = strchr(line, '#');
+		char *tok;
+		lineno++;
+		if (p) *p = '\0';
+		if (!(tok = strtok(line, " \t\r\n"))) continue;
+		if (n_events == MAX_EVENTS) {
+			fprintf(stderr, "line %d: scripts are limited to %d events\n", lineno, MAX_EVENTS);
+			exit(2);
+		}
+		memset(e, 0, sizeof(*e));
+		e->at = cycles(strtod(tok, NULL));
+		if (n_events && e->at < events[n_events-1].at) {
+			fprintf(stderr, "line %d: events must be in chronological order\n", lineno);
+			exit(2);
+		}
+		tok = strtok(NULL, " \t\r\n");
+		if (!tok) {
+			fprintf(stderr, "line %d: missing event type\n", lineno);
+			exit(2);
+		} else if (strcmp(tok, "out") == 0 || strcmp(tok, "in") == 0) {
+			e->type = (tok[0] == 'i') ? EV_IN : EV_OUT;
+			e->request = strtol(strtok(NULL, " \t\r\n") ?: "0", NULL, 0);
+			e->value = strtol(strtok(NULL, " \t\r\n") ?: "0", NULL, 0);
+			e->index = strtol(strtok(NULL, " \t\r\n") ?: "0", NULL, 0);
+			if (e->type == EV_IN) {
+				e->length = strtol(strtok(NULL, " \t\r\n") ?: "0", NULL, 0);
+			}
+		} else if (strcmp(tok, "stream") == 0) {
+			e->type = EV_STREAM;
+		} else if (strcmp(tok, "end") == 0) {
+			e->type = EV_END;
+		} else {
+			fprintf(stderr, "line %d: unknown event %s\n", lineno, tok);
+			exit(2);
+		}
+		if (e->type == EV_OUT || e->type == EV_STREAM) {
+			while ((tok = strtok(NULL, " \t\r\n")) && e->length < MAX_DATA) {
+				e->data[e->length++] = strtol(tok, NULL, 0);
+			}
+		}
+		n_events++;
+	}
+	if (!n_events || events[n_events-1].type != EV_END) {
+		/* make sure the simulation terminates */
+		events[n_events].at = n_events ? events[n_events-1].at + cycles(1000) : cycles(1000);
+		events[n_events].type = EV_END;
+		n_events++;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	FILE *f = stdin;
+	int opt;
+	int i;
+	while ((opt = getopt(argc, argv, "l:v")) != -1) {
+		switch (opt) {
+			case 'l':
+				loop_cycles = atoi(optarg);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-v] [-l cycles per main loop] [script]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (optind < argc && !(f = fopen(argv[optind], "r"))) {
+		perror(argv[optind]);
+		return 2;
+	}
+	load_script(f);
+	for (i = 0; i < N_TUBES; i++) {
+		shown[i] = -1;
+	}
+	firmware_main();
+	fail("firmware main() returned");
+	return 1;
+}
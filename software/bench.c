@@ -0,0 +1,150 @@
+/*
+ * bench.c
+ *
+ * Measures how fast updates get to the display: nixie-bench drives
+ * the boards attached, nixie-bench-mock the boards of mockusb.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "device.h"
+#include "command.h"
+
+#define DEFAULT_COUNT 1000
+/* lines the read test hands over at once, like a pipe does */
+#define READ_BATCH 64
+
+struct bench {
+	const char *name;
+	/* what a single measurement covers */
+	const char *unit;
+	int (*run)(struct nixie *dev, int i);
+};
+
+static FILE *devnull;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a plain command that leaves the display alone, each one a control
+ * transfer of its own */
+static int run_msg(struct nixie *dev, int i) {
+	return nixie_ping(dev);
+}
+
+static int run_number(struct nixie *dev, int i) {
+	return set_number(dev, i, 0);
+}
+
+static int run_color(struct nixie *dev, int i) {
+	return set_color(dev, i & 0xff, (i >> 8) & 0xff, 0);
+}
+
+/* text commands batched the way nixie read does */
+static int run_read(struct nixie *dev, int i) {
+	char line[64];
+	int r = 0;
+	int j;
+	nixie_batch(dev, 1);
+	for (j = 0; j < READ_BATCH; j++) {
+		snprintf(line, sizeof(line), (j & 1) ? "color:%u/0/0" : "num:%u", (i*READ_BATCH + j) & 0xff);
+		if (process_command(dev, line, devnull)) r = 1;
+	}
+	return nixie_batch(dev, 0) || r;
+}
+
+static struct bench benches[] = {
+	{ "msg", "command", run_msg },
+	{ "number", "command", run_number },
+	{ "color", "command", run_color },
+	{ "read", "batch", run_read },
+};
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* times count runs of a benchmark, with wait set each run is followed
+ * by waiting for its transfers to complete */
+static int run_bench(struct nixie *dev, struct bench *b, int count, uint8_t wait) {
+	double *lat = malloc(count * sizeof(*lat));
+	unsigned long transfers = dev->transfers;
+	unsigned long retries = dev->retries;
+	double start, t, total;
+	int failed = 0;
+	int i;
+
+	if (!lat) return 1;
+	start = now();
+	for (i = 0; i < count; i++) {
+		t = now();
+		if (b->run(dev, i)) failed++;
+		if (wait && nixie_wait(dev)) failed++;
+		lat[i] = now() - t;
+	}
+	if (nixie_wait(dev)) failed++;
+	total = now() - start;
+	qsort(lat, count, sizeof(*lat), cmp_double);
+	transfers = dev->transfers - transfers;
+	printf("%-8s %7d %-7s %9.0f %s/s %9.0f transfers/s  p50 %8.1f us  p99 %8.1f us  retries %lu  failed %d\n",
+		b->name, count, b->unit, count / total, b->unit, transfers / total,
+		lat[count/2] * 1e6, lat[count*99/100] * 1e6, dev->retries - retries, failed);
+	free(lat);
+	return failed != 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct nixie dev;
+	int count = DEFAULT_COUNT;
+	uint8_t wait = 0;
+	int failed = 0;
+	int opt;
+	int i, j;
+
+	while ((opt = getopt(argc, argv, "n:w")) != -1) {
+		switch (opt) {
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'w':
+				wait = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-w] [-n count] [msg|number|color|read...]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (count < 1) count = 1;
+	devnull = fopen("/dev/null", "w");
+	if (!devnull) {
+		perror("Unable to open /dev/null");
+		return 1;
+	}
+	if (!nixie_open(&dev)) {
+		perror("Unable to open usb device");
+		return 1;
+	}
+	printf("%u boards, %u tubes, %s\n", dev.boards, dev.tubes,
+		wait ? "waiting for every command" : "commands pipelined");
+
+	for (j = 0; j < (int) (sizeof(benches) / sizeof(benches[0])); j++) {
+		uint8_t selected = (optind == argc);
+		for (i = optind; i < argc; i++) {
+			if (strcmp(argv[i], benches[j].name) == 0) selected = 1;
+		}
+		if (selected && run_bench(&dev, &benches[j], count, wait)) failed = 1;
+	}
+	nixie_close(&dev);
+	fclose(devnull);
+	return failed;
+}
@@ -0,0 +1,361 @@
+/*
+ * command.c
+ *
+ * The textual command grammar understood by nixie and nixied
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "command.h"
+
+#define MAX_ARGS 4
+
+/* a command taken apart by tokenize() */
+struct tokens {
+	char name[16];
+	/* the number glued to the name, -1 if there is none */
+	int index;
+	int argc;
+	int arg[MAX_ARGS];
+	/* everything after the first ':' */
+	const char *rest;
+	/* nothing follows the name */
+	uint8_t bare;
+};
+
+/* compile a sequence like "mark;d:123;c:255/0/0;h:500;loop" into a
+ * program for the sequencer of a board, digits and LEDs are numbered
+ * across the whole display; returns its length, -1 if the sequence
+ * cannot be parsed or -2 if it is longer than size */
+static int parse_sequence(struct board *bd, const char *seq, uint8_t *prog, int size) {
+	char buf[1024];
+	char *step, *save;
+	uint8_t op[1+NIXIE_MAX_TUBES];
+	int l = 0;
+	int n;
+	int tube, v, r, g, b, len, i;
+	strncpy(buf, seq, sizeof(buf)-1);
+	buf[sizeof(buf)-1] = '\0';
+	for (step = strtok_r(buf, ";", &save); step; step = strtok_r(NULL, ";", &save)) {
+		n = 0;
+		if (strncmp(step, "d:", 2) == 0) {
+			/* the last digit goes to the first tube, as with num */
+			len = strlen(step+2);
+			op[n++] = SEQ_OP_TUBES;
+			for (i = bd->first; i < bd->first + bd->tubes; i++) {
+				char c = (i < len) ? step[2+len-1-i] : ' ';
+				op[n++] = (c >= '0' && c <= '9') ? c-'0' : TUBE_OFF;
+			}
+		} else if (sscanf(step, "c:%d/%d/%d", &r, &g, &b) == 3) {
+			if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) return -1;
+			op[n++] = SEQ_OP_COLOR;
+			op[n++] = r;
+			op[n++] = g;
+			op[n++] = b;
+		} else if (sscanf(step, "l%d:%d/%d/%d", &tube, &r, &g, &b) == 4 && tube >= 0) {
+			if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) return -1;
+			/* the LED is on another board */
+			if (tube < bd->first || tube >= bd->first + bd->tubes) continue;
+			op[n++] = SEQ_OP_LED;
+			op[n++] = tube - bd->first;
+			op[n++] = r;
+			op[n++] = g;
+			op[n++] = b;
+		} else if (sscanf(step, "h:%d", &v) == 1 && v >= 0) {
+			/* hold times are counted in ticks of 5ms */
+			v = (v+4) / 5;
+			if (v > 0xffff) v = 0xffff;
+			op[n++] = SEQ_OP_HOLD;
+			op[n++] = v & 0xff;
+			op[n++] = v >> 8;
+		} else if (strcmp(step, "mark") == 0) {
+			op[n++] = SEQ_OP_MARK;
+		} else if (strcmp(step, "loop") == 0) {
+			op[n++] = SEQ_OP_LOOP;
+		} else if (strcmp(step, "end") == 0) {
+			op[n++] = SEQ_OP_END;
+		} else {
+			return -1;
+		}
+		if (l + n > size) return -2;
+		memcpy(&prog[l], op, n);
+		l += n;
+	}
+	return l;
+}
+
+/* the counter runs on the first board only, see set_counter() */
+static void counter_note(struct nixie *dev, FILE *out) {
+	if (dev->tubes > dev->board[0].tubes) {
+		fprintf(out, "Only the %u tubes of board %s count, the others are turned off\n",
+			dev->board[0].tubes, dev->board[0].serial);
+	}
+}
+
+static void print_timing(FILE *out, const char *name, struct nixie_timing *t, uint16_t khz) {
+	if (!t->count) {
+		fprintf(out, "  %-10s -\n", name);
+		return;
+	}
+	fprintf(out, "  %-10s min %8.1f us  avg %8.1f us  max %8.1f us  (%u)\n", name,
+		t->min * 1000.0 / khz, (double) t->sum / t->count * 1000.0 / khz,
+		t->max * 1000.0 / khz, t->count);
+}
+
+static int print_stats(struct nixie *dev, uint8_t reset, FILE *out) {
+	struct nixie_stats st;
+	uint8_t i;
+	for (i = 0; i < dev->boards; i++) {
+		struct board *bd = &dev->board[i];
+		if (read_stats(bd, &st, reset) || !st.timer_khz) {
+			fprintf(out, "board %s: no statistics\n", bd->serial);
+			continue;
+		}
+		fprintf(out, "board %s: %u ticks (%u missed), %u multiplex steps, %.1f loops per step\n",
+			bd->serial, st.ticks, st.missed_ticks, st.mux_steps,
+			st.mux_steps ? (double) st.loop.count / st.mux_steps : 0.0);
+		print_timing(out, "tick delay", &st.tick_delay, st.timer_khz);
+		print_timing(out, "loop", &st.loop, st.timer_khz);
+		print_timing(out, "animate", &st.animate, st.timer_khz);
+		print_timing(out, "usb task", &st.usb_task, st.timer_khz);
+		print_timing(out, "control", &st.control, st.timer_khz);
+	}
+	return 0;
+}
+
+/* split a command in one pass into its name, a number glued to the
+ * name (t0, l3) and the numbers following it, separated by ':' or '/' */
+static void tokenize(const char *cmd, struct tokens *t) {
+	const char *p = cmd;
+	char *end;
+	size_t l = 0;
+	t->index = -1;
+	t->argc = 0;
+	t->rest = "";
+	while (isalpha((unsigned char) *p) && l < sizeof(t->name)-1) t->name[l++] = *p++;
+	t->name[l] = '\0';
+	t->bare = (*p == '\0');
+	if (isdigit((unsigned char) *p)) {
+		t->index = strtol(p, &end, 10);
+		p = end;
+	}
+	if (*p != ':') return;
+	t->rest = ++p;
+	while (t->argc < MAX_ARGS) {
+		t->arg[t->argc] = strtol(p, &end, 10);
+		if (end == p) break;
+		t->argc++;
+		if (*end != ':' && *end != '/') break;
+		p = end+1;
+	}
+}
+
+int process_command(struct nixie *dev, char *cmd, FILE *out) {
+	struct tokens t;
+	int *a = t.arg;
+	int value = 0;
+	int speed = 0;
+	uint8_t prog[256];
+	char inner[256];
+	const char *next;
+	uint8_t i;
+	time_t now;
+	struct tm *tm;
+
+	tokenize(cmd, &t);
+	if (strcmp(t.name, "t") == 0 && t.index >= 0 && t.argc >= 1 && a[0] >= 0) {
+		fprintf(out, "Setting nixie tube %u to %u.\n", t.index, a[0]);
+		return set_tube(dev, t.index, a[0]);
+	} else if (strcmp(t.name, "l") == 0 && t.index >= 0 && t.argc >= 3) {
+		fprintf(out, "Setting nixie LED %u to %u/%u/%u.\n", t.index, a[0], a[1], a[2]);
+		return set_led(dev, t.index, a[0], a[1], a[2]);
+	} else if (strcmp(t.name, "anim") == 0 && t.argc >= 2 && a[0] >= 0) {
+		fprintf(out, "Setting animation style %u with speed %u.\n", a[0], a[1]);
+		return set_animation(dev, a[0], a[1]);
+	} else if (strcmp(t.name, "lnum") == 0 && t.argc >= 1 && a[0] >= 0) {
+		fprintf(out, "Setting number %u\n", a[0]);
+		return set_number(dev, a[0], 1);
+	} else if (strcmp(t.name, "num") == 0 && t.argc >= 1 && a[0] >= 0) {
+		fprintf(out, "Setting number %u\n", a[0]);
+		return set_number(dev, a[0], 0);
+	} else if (strcmp(t.name, "color") == 0 && t.argc >= 3) {
+		fprintf(out, "Setting color %u/%u/%u\n", a[0], a[1], a[2]);
+		return set_color(dev, a[0], a[1], a[2]);
+	} else if (strcmp(t.name, "fade") == 0 && t.argc >= 4 && a[3] >= 0) {
+		if (t.index >= 0) {
+			fprintf(out, "Fading nixie LED %u to %u/%u/%u within %u ms\n", t.index, a[0], a[1], a[2], a[3]);
+		} else {
+			fprintf(out, "Fading to color %u/%u/%u within %u ms\n", a[0], a[1], a[2], a[3]);
+		}
+		return fade_led(dev, t.index, a[0], a[1], a[2], a[3]);
+	} else if (strcmp(t.name, "rate") == 0 && t.argc >= 1 && a[0] >= 0 && (t.argc < 2 || a[1] >= 0)) {
+		value = (t.argc < 2) ? 0 : a[1];
+		fprintf(out, "Setting the multiplex rate to %u Hz with %u us blanking\n", a[0], value);
+		return set_mux(dev, a[0], value);
+	} else if (strcmp(t.name, "bright") == 0 && t.argc >= 1 && a[0] >= 0) {
+		if (t.index >= 0) {
+			fprintf(out, "Setting the brightness of nixie tube %u to %u%%\n", t.index, a[0]);
+		} else {
+			fprintf(out, "Setting the brightness to %u%%\n", a[0]);
+		}
+		return set_brightness(dev, t.index, a[0]);
+	} else if (strcmp(t.name, "off") == 0 && t.bare) {
+		fprintf(out, "Turning off all tubes...\n");
+		return tubes_off(dev);
+	} else if (strcmp(t.name, "refresh") == 0 && t.argc >= 1 && a[0] >= 0) {
+		fprintf(out, "Refreshing the whole display every %u seconds\n", a[0]);
+		dev->refresh = a[0];
+		return 0;
+	} else if (strcmp(t.name, "tubes") == 0 && t.argc >= 1 && a[0] > 0 && a[0] <= NIXIE_MAX_TUBES) {
+		fprintf(out, "Using %u tubes per board\n", a[0]);
+		set_tube_count(dev, a[0]);
+		return 0;
+	} else if (strcmp(t.name, "info") == 0 && t.bare) {
+		if (nixie_sync(dev)) {
+			fprintf(out, "Unable to query the device\n");
+			return 1;
+		}
+		for (i = 0; i < dev->boards; i++) {
+			struct board *bd = &dev->board[i];
+			fprintf(out, "board %s: tubes %u-%u%s%s%s%s%s\n", bd->serial[0] ? bd->serial : "?",
+				bd->first, bd->first + bd->tubes - 1,
+				(bd->features & NIXIE_FEATURE_ANIMATION) ? ", animation" : "",
+				(bd->features & NIXIE_FEATURE_STREAMING) ? ", streaming" : "",
+				(bd->features & NIXIE_FEATURE_LED_FADE) ? ", LED fades" : "",
+				(bd->features & NIXIE_FEATURE_SEQUENCE) ? ", numbered requests" : "",
+				(bd->features2 & NIXIE_FEATURE2_MUX) ? ", dimming" : "");
+		}
+		fprintf(out, "%u tubes\n", dev->tubes);
+		for (i = 0; i < dev->tubes; i++) {
+			fprintf(out, "t%u:%u l%u:%u/%u/%u\n", i, dev->shown.tube[i], i,
+				dev->shown.led[i][0], dev->shown.led[i][1], dev->shown.led[i][2]);
+		}
+		fprintf(out, "anim:%u:%u\n", dev->shown.anim_style, dev->shown.anim_speed);
+		return 0;
+	} else if (strcmp(t.name, "stats") == 0 && (t.bare || strcmp(t.rest, "reset") == 0)) {
+		return print_stats(dev, !t.bare, out);
+	} else if (strcmp(t.name, "frames") == 0 && t.bare) {
+		/* the frame clocks of the boards, "clock" runs a clock on the tubes */
+		for (i = 0; i < dev->boards; i++) {
+			struct board *bd = &dev->board[i];
+			if (read_clock(bd)) {
+				fprintf(out, "board %s: no clock\n", bd->serial);
+				continue;
+			}
+			fprintf(out, "board %s: frame %u, %.3f ms per frame, round trip %.3f ms\n",
+				bd->serial, bd->clock_frame, bd->frame_length * 1000, bd->latency * 1000);
+		}
+		return 0;
+	} else if (strcmp(t.name, "at") == 0 && t.argc >= 1 && a[0] >= 0 && (next = strchr(t.rest, ':'))) {
+		/* what the command changes is shown on all boards together in a[0] ms */
+		uint8_t batch = dev->batch;
+		strncpy(inner, next+1, sizeof(inner)-1);
+		inner[sizeof(inner)-1] = '\0';
+		if (batch && nixie_batch(dev, 0)) return 1;
+		nixie_batch(dev, 1);
+		value = process_command(dev, inner, out);
+		if (value == 0) value = nixie_flush_at(dev, a[0]);
+		dev->batch = batch;
+		return value;
+	} else if (strcmp(t.name, "seq") == 0 && strcmp(t.rest, "stop") == 0) {
+		fprintf(out, "Stopping the sequence\n");
+		return set_sequence(dev, 0);
+	} else if (strcmp(t.name, "seq") == 0 && *t.rest) {
+		/* every board plays its share, started together once all are uploaded */
+		for (i = 0; i < dev->boards; i++) {
+			struct board *bd = &dev->board[i];
+			/* prog holds the largest sequence_size a board can report */
+			value = parse_sequence(bd, t.rest, prog, bd->sequence_size);
+			if (value == -1) return 2;
+			if (value < 0) {
+				fprintf(out, "The sequence does not fit board %s\n", bd->serial);
+				return 1;
+			}
+			if (send_sequence(bd, prog, value)) return 1;
+		}
+		fprintf(out, "Playing a sequence of %u bytes\n", value);
+		return set_sequence(dev, 1);
+	} else if (strcmp(t.name, "count") == 0 && strcmp(t.rest, "stop") == 0) {
+		fprintf(out, "Stopping the counter\n");
+		return set_counter(dev, 0, 0, 0);
+	} else if (strcmp(t.name, "count") == 0 && t.argc >= 1 && a[0] >= 0) {
+		speed = (t.argc < 2) ? 1000 : a[1];
+		fprintf(out, "Counting up from %u every %u ms\n", a[0], speed);
+		counter_note(dev, out);
+		return set_counter(dev, 0, a[0], speed);
+	} else if (strcmp(t.name, "countdown") == 0 && t.argc >= 1 && a[0] >= 0) {
+		speed = (t.argc < 2) ? 1000 : a[1];
+		fprintf(out, "Counting down from %u every %u ms\n", a[0], speed);
+		counter_note(dev, out);
+		return set_counter(dev, CUSTOM_RQ_COUNTER_DOWN, a[0], speed);
+	} else if (strcmp(t.name, "clock") == 0 && (t.bare || t.argc >= 3)) {
+		if (t.bare) {
+			now = time(NULL);
+			tm = localtime(&now);
+			a[0] = tm->tm_hour;
+			a[1] = tm->tm_min;
+			a[2] = tm->tm_sec;
+		}
+		fprintf(out, "Running a clock from %02u:%02u:%02u\n", a[0], a[1], a[2]);
+		counter_note(dev, out);
+		return set_counter(dev, CUSTOM_RQ_COUNTER_CLOCK | CUSTOM_RQ_COUNTER_LEADING_ZERO,
+			(a[0]*60 + a[1])*60 + a[2], 1000);
+	} else if (strcmp(t.name, "begin") == 0 && t.bare) {
+		fprintf(out, "Holding back updates...\n");
+		return set_hold(dev, 1);
+	} else if (strcmp(t.name, "commit") == 0 && t.bare) {
+		fprintf(out, "Committing updates...\n");
+		return set_hold(dev, 0);
+	}
+	return 2;
+}
+
+/* length of a binary command by its opcode, 0 if unknown */
+static const uint8_t bin_len[] = {
+	[BIN_TUBE] = 3,
+	[BIN_LED] = 5,
+	[BIN_ANIMATION] = 3,
+	[BIN_NUMBER] = 6,
+	[BIN_COLOR] = 4,
+	[BIN_OFF] = 1,
+	[BIN_BEGIN] = 1,
+	[BIN_COMMIT] = 1,
+};
+
+int process_binary(struct nixie *dev, const uint8_t *buf, int len) {
+	uint8_t l;
+	int r = 0;
+	if (len < 1) return 0;
+	if (buf[0] >= sizeof(bin_len) || !(l = bin_len[buf[0]])) return -1;
+	if (len < l) return 0;
+	switch (buf[0]) {
+		case BIN_TUBE:
+			r = set_tube(dev, buf[1], buf[2]);
+			break;
+		case BIN_LED:
+			r = set_led(dev, buf[1], buf[2], buf[3], buf[4]);
+			break;
+		case BIN_ANIMATION:
+			r = set_animation(dev, buf[1], buf[2]);
+			break;
+		case BIN_NUMBER:
+			r = set_number(dev, (buf[2] | buf[3]<<8 | buf[4]<<16 | (uint32_t) buf[5]<<24) & 0x7fffffff,
+				buf[1] & BIN_LEADING_ZERO);
+			break;
+		case BIN_COLOR:
+			r = set_color(dev, buf[1], buf[2], buf[3]);
+			break;
+		case BIN_OFF:
+			r = tubes_off(dev);
+			break;
+		case BIN_BEGIN:
+		case BIN_COMMIT:
+			r = set_hold(dev, buf[0] == BIN_BEGIN);
+			break;
+	}
+	return r ? -2 : l;
+}
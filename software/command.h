@@ -0,0 +1,41 @@
+/*
+ * command.h
+ *
+ * The command grammar understood by nixie and nixied
+ */
+
+#ifndef __COMMAND_H_INCLUDED__
+#define __COMMAND_H_INCLUDED__
+
+#include <stdio.h>
+#include "device.h"
+
+/* returns 0 on success, 1 if the device could not be updated
+ * and 2 if the command could not be parsed */
+int process_command(struct nixie *dev, char *cmd, FILE *out);
+
+/* compact binary commands (nixie readb), an opcode followed by
+ * a fixed number of bytes:
+ *   BIN_TUBE tube value
+ *   BIN_LED led r g b
+ *   BIN_ANIMATION style speed
+ *   BIN_NUMBER flags value (32 bit, little endian)
+ *   BIN_COLOR r g b
+ *   BIN_OFF, BIN_BEGIN, BIN_COMMIT */
+#define BIN_TUBE 1
+#define BIN_LED 2
+#define BIN_ANIMATION 3
+#define BIN_NUMBER 4
+#define BIN_COLOR 5
+#define BIN_OFF 6
+#define BIN_BEGIN 7
+#define BIN_COMMIT 8
+
+#define BIN_LEADING_ZERO 1
+
+/* runs the first command in buf and returns its length, 0 if buf does
+ * not hold a whole command yet, -1 if the opcode is unknown and -2 if
+ * the device could not be updated */
+int process_binary(struct nixie *dev, const uint8_t *buf, int len);
+
+#endif /* __COMMAND_H_INCLUDED__ */
@@ -0,0 +1,1372 @@
+/*
+ * device.c
+ *
+ * USB access to the nixie display, shared by nixie and nixied
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "device.h"
+
+/* mask of n tubes starting at the first one */
+#define TUBE_MASK(n) ((n) >= 32 ? ~(tube_mask) 0 : ((tube_mask) 1 << (n)) - 1)
+/* mask of all the tubes of the display */
+#define ALL_TUBES(dev) TUBE_MASK((dev)->tubes)
+/* mask of the tubes of a board within the display */
+#define BOARD_TUBES(b) (TUBE_MASK((b)->tubes) << (b)->first)
+
+/* requests on their way to a board at once, the firmware queues
+ * three control requests */
+#define MAX_IN_FLIGHT 3
+/* a failed request is sent again after 5ms, 10ms, 20ms, ... */
+#define MAX_RETRIES 10
+#define RETRY_DELAY(n) (0.005 * (1 << ((n) < 8 ? (n)-1 : 7)))
+#define USB_TIMEOUT 100
+/* how often to look for a lost board in case no hotplug event tells us */
+#define RESCAN_INTERVAL 1.0
+/* the clock of a board is read this often, keeping the fastest answer,
+ * and read again after this many seconds */
+#define CLOCK_SAMPLES 3
+#define CLOCK_RESYNC 60.0
+
+/* a transfer on its way to a board */
+struct request {
+	struct board *board;
+	struct libusb_transfer *transfer;
+	/* the display state it sets, such requests are not sent again
+	 * but the state is flushed anew if they fail */
+	tube_mask tubes;
+	tube_mask leds;
+	uint8_t anim;
+	/* commands are sent again as they are */
+	uint8_t resend;
+	/* CUSTOM_RQ_SEQ_FLAG and its number once sent to a board that counts them */
+	uint8_t seq;
+	uint8_t tries;
+	double due;
+	struct request *next;
+};
+
+/* serial numbers listed in the config file, in display order */
+static int read_config(char serials[][64], int max) {
+	const char *path = getenv("NIXIE_CONFIG");
+	char line[256];
+	int n = 0;
+	FILE *f;
+	if (!path) path = DEFAULT_CONFIG;
+	if (!(f = fopen(path, "r"))) return 0;
+	while (n < max && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " %63[^# \t\r\n]", serials[n]) == 1) n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/* boards listed in the config come first and in its order, the others
+ * follow sorted by their serial numbers */
+static int board_rank(char serials[][64], int n, const char *serial) {
+	int i;
+	for (i = 0; i < n; i++) {
+		if (strcmp(serials[i], serial) == 0) return i;
+	}
+	return n;
+}
+
+static void sort_boards(struct nixie *dev) {
+	char serials[MAX_BOARDS][64];
+	int n = read_config(serials, MAX_BOARDS);
+	struct board tmp;
+	int i, j;
+	for (i = 1; i < dev->boards; i++) {
+		for (j = i; j > 0; j--) {
+			struct board *a = &dev->board[j-1];
+			struct board *b = &dev->board[j];
+			int ra = board_rank(serials, n, a->serial);
+			int rb = board_rank(serials, n, b->serial);
+			if (ra < rb || (ra == rb && strcmp(a->serial, b->serial) <= 0)) break;
+			tmp = *a;
+			*a = *b;
+			*b = tmp;
+		}
+	}
+}
+
+/* open a device if it is one of our boards, returns NULL if it is not */
+static libusb_device_handle *open_board(libusb_device *d, char *serial, int size) {
+	libusb_device_handle *target;
+	struct libusb_device_descriptor desc;
+	unsigned char vendor[256];
+	unsigned char product[256];
+
+	if (libusb_get_device_descriptor(d, &desc) != 0 ||
+	    desc.idVendor != USB_VID || desc.idProduct != USB_PID ||
+	    libusb_open(d, &target) != 0) {
+		return NULL;
+	}
+	if (libusb_get_string_descriptor_ascii(target, desc.iManufacturer, vendor, sizeof(vendor)) < 0 ||
+	    libusb_get_string_descriptor_ascii(target, desc.iProduct, product, sizeof(product)) < 0 ||
+	    strcmp((char *) vendor, V_NAME) != 0 || strcmp((char *) product, P_NAME) != 0) {
+		/* not our device */
+		libusb_close(target);
+		return NULL;
+	}
+	if (libusb_get_string_descriptor_ascii(target, desc.iSerialNumber, (unsigned char *) serial, size) < 0) {
+		serial[0] = '\0';
+	}
+	libusb_claim_interface(target, 0);
+	return target;
+}
+
+/* open every board showing our vendor and product name */
+static int open_boards(struct nixie *dev) {
+	libusb_device **list;
+	libusb_device_handle *target;
+	struct board *b;
+	ssize_t n;
+	ssize_t i;
+
+	n = libusb_get_device_list(dev->ctx, &list);
+	if (n < 0) return 0;
+	for (i = 0; i < n && dev->boards < MAX_BOARDS; i++) {
+		b = &dev->board[dev->boards];
+		memset(b, 0, sizeof(*b));
+		if (!(target = open_board(list[i], b->serial, sizeof(b->serial)))) continue;
+		b->handle = target;
+		b->tubes = DEFAULT_TUBES;
+		/* what the firmware supports unless it tells us otherwise */
+		b->features = NIXIE_FEATURE_ANIMATION | NIXIE_FEATURE_STREAMING;
+		/* a board that just started got request 0 last */
+		b->next_seq = 1;
+		dev->boards++;
+	}
+	libusb_free_device_list(list, 1);
+	sort_boards(dev);
+	for (i = 0; i < dev->boards; i++) {
+		dev->board[i].dev = dev;
+	}
+	return dev->boards;
+}
+
+/* place the boards side by side, the first one shows the last digits */
+static void layout(struct nixie *dev) {
+	uint8_t first = 0;
+	uint8_t i;
+	dev->features = 0xff;
+	for (i = 0; i < dev->boards; i++) {
+		struct board *b = &dev->board[i];
+		if (b->tubes > MAX_TUBES - first) b->tubes = MAX_TUBES - first;
+		b->first = first;
+		first += b->tubes;
+		dev->features &= b->features;
+	}
+	dev->tubes = first;
+	dev->want_tubes &= ALL_TUBES(dev);
+	dev->want_leds &= ALL_TUBES(dev);
+	dev->known_tubes &= ALL_TUBES(dev);
+	dev->known_leds &= ALL_TUBES(dev);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void transfer_done(struct libusb_transfer *t);
+
+/* set up a transfer for a control request, it is freed once it completes */
+static struct request *new_request(struct board *b, uint8_t req, uint16_t value, uint16_t index, uint8_t *buf, uint8_t l) {
+	struct request *r = calloc(1, sizeof(*r));
+	unsigned char *data = malloc(LIBUSB_CONTROL_SETUP_SIZE + l);
+	struct libusb_transfer *t = libusb_alloc_transfer(0);
+	if (!r || !data || !t) {
+		free(r);
+		free(data);
+		libusb_free_transfer(t);
+		return NULL;
+	}
+	libusb_fill_control_setup(data,
+		LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+		req, value, index, l);
+	memcpy(data + LIBUSB_CONTROL_SETUP_SIZE, buf, l);
+	libusb_fill_control_transfer(t, b->handle, data, transfer_done, r, USB_TIMEOUT);
+	t->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	r->board = b;
+	r->transfer = t;
+	r->resend = 1;
+	return r;
+}
+
+static void free_request(struct request *r) {
+	libusb_free_transfer(r->transfer);
+	free(r);
+}
+
+static void give_up(struct nixie *dev) {
+	fprintf(stderr, "Error sending command\n");
+	dev->failed = 1;
+}
+
+/* a board went away, what it showed becomes wanted again so it is
+ * replayed in one frame once the board is back */
+static void lose_board(struct board *b) {
+	struct nixie *dev = b->dev;
+	uint8_t i;
+	if (b->lost) return;
+	fprintf(stderr, "Lost board %s\n", b->serial);
+	b->lost = 1;
+	for (i = b->first; i < b->first + b->tubes; i++) {
+		tube_mask m = (tube_mask) 1 << i;
+		if ((dev->known_tubes & m) && !(dev->want_tubes & m)) {
+			dev->want.tube[i] = dev->shown.tube[i];
+			dev->want_tubes |= m;
+		}
+		if ((dev->known_leds & m) && !(dev->want_leds & m)) {
+			memcpy(dev->want.led[i], dev->shown.led[i], 3);
+			dev->want_leds |= m;
+		}
+	}
+	if (b->known_anim && !dev->want_anim) {
+		dev->want.anim_style = dev->shown.anim_style;
+		dev->want.anim_speed = dev->shown.anim_speed;
+		dev->want_anim = 1;
+	}
+	dev->known_tubes &= ~BOARD_TUBES(b);
+	dev->known_leds &= ~BOARD_TUBES(b);
+	b->known_anim = 0;
+	/* it starts counting frames and requests anew */
+	b->clock_synced = 0;
+	b->resync = 1;
+	b->resync_seq = b->next_seq;
+	if (!dev->rescan_at) dev->rescan_at = now();
+}
+
+/* close lost boards once their last transfer has come back */
+static void close_lost(struct nixie *dev) {
+	struct request *r;
+	uint8_t i;
+	for (i = 0; i < dev->boards; i++) {
+		struct board *b = &dev->board[i];
+		if (!b->lost || !b->handle || b->in_flight) continue;
+		while ((r = b->queue)) {
+			b->queue = r->next;
+			free_request(r);
+		}
+		b->queue_tail = NULL;
+		while ((r = b->failed)) {
+			b->failed = r->next;
+			free_request(r);
+		}
+		libusb_release_interface(b->handle, 0);
+		libusb_close(b->handle);
+		b->handle = NULL;
+	}
+}
+
+static uint8_t board_open(struct nixie *dev, libusb_device *d) {
+	uint8_t i;
+	for (i = 0; i < dev->boards; i++) {
+		if (dev->board[i].handle && libusb_get_device(dev->board[i].handle) == d) return 1;
+	}
+	return 0;
+}
+
+/* queue a command behind the others without waiting for it, for use
+ * from within run_events() */
+static void queue_later(struct board *b, uint8_t *buf, uint8_t l) {
+	struct request *r = new_request(b, CUSTOM_RQ_SET_NIXIE, 0, 0, buf, l);
+	if (!r) return;
+	if (b->queue_tail) {
+		b->queue_tail->next = r;
+	} else {
+		b->queue = r;
+	}
+	b->queue_tail = r;
+}
+
+/* send the multiplex rate and brightness again to a board that is back,
+ * they go out after the state replayed by the reflush */
+static void restore_mux(struct board *b) {
+	struct nixie *dev = b->dev;
+	uint8_t buf[8] = {0};
+	uint8_t i;
+	if (!(b->features2 & NIXIE_FEATURE2_MUX)) return;
+	if (dev->mux_set) {
+		buf[0] = CUSTOM_RQ_CONST_MUX;
+		buf[2] = dev->mux_rate & 0xff;
+		buf[3] = dev->mux_rate >> 8;
+		buf[4] = dev->mux_blank & 0xff;
+		buf[5] = dev->mux_blank >> 8;
+		queue_later(b, buf, sizeof(buf));
+	}
+	memset(buf, 0, sizeof(buf));
+	buf[0] = CUSTOM_RQ_CONST_BRIGHTNESS;
+	for (i = 0; i < b->tubes; i++) {
+		if (!(dev->dimmed & (tube_mask) 1 << (b->first + i))) continue;
+		buf[1] = i;
+		buf[2] = dev->brightness[b->first + i];
+		queue_later(b, buf, sizeof(buf));
+	}
+}
+
+/* reopen lost boards that are back, boards not seen before are left alone */
+static void rescan(struct nixie *dev) {
+	libusb_device **list;
+	libusb_device_handle *target;
+	char serial[64];
+	struct board *b;
+	uint8_t lost = 0;
+	ssize_t n;
+	ssize_t i;
+	uint8_t j;
+
+	n = libusb_get_device_list(dev->ctx, &list);
+	for (i = 0; i < n; i++) {
+		if (board_open(dev, list[i]) || !(target = open_board(list[i], serial, sizeof(serial)))) continue;
+		b = NULL;
+		for (j = 0; j < dev->boards && !b; j++) {
+			if (dev->board[j].lost && !dev->board[j].handle && strcmp(dev->board[j].serial, serial) == 0) {
+				b = &dev->board[j];
+			}
+		}
+		if (!b) {
+			libusb_release_interface(target, 0);
+			libusb_close(target);
+			continue;
+		}
+		fprintf(stderr, "Board %s is back\n", b->serial);
+		b->handle = target;
+		b->lost = 0;
+		dev->reflush_at = now();
+		restore_mux(b);
+	}
+	if (n >= 0) libusb_free_device_list(list, 1);
+	for (j = 0; j < dev->boards; j++) {
+		if (dev->board[j].lost) lost = 1;
+	}
+	/* keep looking even if hotplug events are missed */
+	dev->rescan_at = lost ? now() + RESCAN_INTERVAL : 0;
+}
+
+static int LIBUSB_CALL hotplug(libusb_context *ctx, libusb_device *d, libusb_hotplug_event event, void *user) {
+	struct nixie *dev = user;
+	uint8_t i;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		/* devices are not opened from within the callback */
+		if (dev->rescan_at) dev->rescan_at = now();
+		return 0;
+	}
+	for (i = 0; i < dev->boards; i++) {
+		if (dev->board[i].handle && libusb_get_device(dev->board[i].handle) == d) lose_board(&dev->board[i]);
+	}
+	return 0;
+}
+
+/* a request did not make it to its board, schedule it (or the state
+ * it carried) to be sent again */
+static void request_failed(struct request *r) {
+	struct board *b = r->board;
+	struct nixie *dev = b->dev;
+	struct request **tail;
+	dev->retries++;
+	if (r->seq && !b->resync) {
+		/* it may have got there with only the answer lost, and the
+		 * board turns down the requests sent after it until it has it */
+		b->resync = 1;
+		b->resync_seq = r->seq;
+	}
+	if (!r->resend) {
+		/* a newer frame supersedes the state of this one */
+		dev->known_tubes &= ~r->tubes;
+		dev->known_leds &= ~r->leds;
+		if (r->anim) b->known_anim = 0;
+		if (r->tubes || r->leds || r->anim) {
+			if (++dev->state_failures > MAX_RETRIES) {
+				dev->state_failures = 0;
+				dev->reflush_at = 0;
+				give_up(dev);
+			} else if (!dev->reflush_at) {
+				dev->reflush_at = now() + RETRY_DELAY(dev->state_failures);
+			}
+		} else {
+			/* a streamed frame, the next one replaces it */
+			dev->failed = 1;
+		}
+		free_request(r);
+		return;
+	}
+	if (++r->tries > MAX_RETRIES) {
+		give_up(dev);
+		free_request(r);
+		return;
+	}
+	/* retry ahead of everything queued after it */
+	r->due = now() + RETRY_DELAY(r->tries);
+	if (r->seq) {
+		/* in the order sent, see resync() */
+		for (tail = &b->failed; *tail; tail = &(*tail)->next);
+		r->next = NULL;
+		*tail = r;
+		return;
+	}
+	r->next = b->queue;
+	b->queue = r;
+	if (!b->queue_tail) b->queue_tail = r;
+}
+
+static void transfer_done(struct libusb_transfer *t) {
+	struct request *r = t->user_data;
+	struct board *b = r->board;
+	b->in_flight--;
+	if (t->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		free_request(r);
+		lose_board(b);
+		return;
+	}
+	if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+		request_failed(r);
+		return;
+	}
+	if (r->tubes || r->leds || r->anim) b->dev->state_failures = 0;
+	free_request(r);
+}
+
+static int recv_usb_msg(struct board *b, uint8_t req, uint16_t value, uint8_t *buf, uint8_t l);
+
+/* ask a board which of the failed requests it got after all, the others
+ * are sent again ahead of everything queued and numbered on from the
+ * last one it got */
+static void resync(struct board *b) {
+	struct nixie_ack ack;
+	struct request *r, *next;
+	struct request *retry = NULL, *last = NULL;
+	b->resync = 0;
+	if (recv_usb_msg(b, CUSTOM_RQ_GET_ACK, 0, (uint8_t *) &ack, sizeof(ack)) < (int) sizeof(ack)) {
+		ack.received = b->resync_seq - 1;
+	}
+	for (r = b->failed; r; r = next) {
+		next = r->next;
+		r->next = NULL;
+		if (((ack.received - r->seq) & CUSTOM_RQ_SEQ_MASK) < CUSTOM_RQ_SEQ_WINDOW) {
+			free_request(r);
+			continue;
+		}
+		r->seq = 0;
+		if (last) {
+			last->next = r;
+		} else {
+			retry = r;
+		}
+		last = r;
+	}
+	b->failed = NULL;
+	if (last) {
+		last->next = b->queue;
+		if (!b->queue) b->queue_tail = last;
+		b->queue = retry;
+	}
+	b->next_seq = (ack.received + 1) & CUSTOM_RQ_SEQ_MASK;
+}
+
+/* submit queued requests while the board keeps up with them */
+static void pump(struct board *b) {
+	struct request *r;
+	int err;
+	/* nothing overtakes the state waiting to be sent again */
+	if (b->dev->reflush_at) return;
+	if (b->resync) {
+		if (b->lost || b->in_flight) return;
+		if (b->features & NIXIE_FEATURE_SEQUENCE) resync(b);
+		b->resync = 0;
+	}
+	while (!b->lost && (r = b->queue) && b->in_flight < MAX_IN_FLIGHT && r->due <= now()) {
+		b->queue = r->next;
+		if (!b->queue) b->queue_tail = NULL;
+		r->next = NULL;
+		if ((b->features & NIXIE_FEATURE_SEQUENCE) && r->transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+			/* in the high byte of wIndex */
+			r->seq = CUSTOM_RQ_SEQ_FLAG | b->next_seq;
+			r->transfer->buffer[5] = r->seq;
+		}
+		err = libusb_submit_transfer(r->transfer);
+		if (err == 0) {
+			b->in_flight++;
+			b->dev->transfers++;
+			if (r->seq) b->next_seq = (b->next_seq + 1) & CUSTOM_RQ_SEQ_MASK;
+		} else if (err == LIBUSB_ERROR_NO_DEVICE) {
+			free_request(r);
+			lose_board(b);
+		} else {
+			/* it never left, its number goes to the next one */
+			r->seq = 0;
+			request_failed(r);
+		}
+	}
+}
+
+/* flush even within a batch, for state that must not wait for its end
+ * and for commands that must not overtake it */
+static int flush_now(struct nixie *dev) {
+	uint8_t batch = dev->batch;
+	int r;
+	dev->batch = 0;
+	r = nixie_flush(dev);
+	dev->batch = batch;
+	return r;
+}
+
+/* handle completed transfers and whatever is due, waiting at most timeout_ms */
+static void run_events(struct nixie *dev, int timeout_ms) {
+	struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+	struct request *queued[MAX_BOARDS];
+	struct request *queued_tail[MAX_BOARDS];
+	struct board *b;
+	uint8_t i;
+	libusb_handle_events_timeout(dev->ctx, &tv);
+	close_lost(dev);
+	if (dev->rescan_at && now() >= dev->rescan_at) rescan(dev);
+	if (dev->reflush_at && now() >= dev->reflush_at) {
+		/* send the state ahead of the requests queued meanwhile */
+		for (i = 0; i < dev->boards; i++) {
+			b = &dev->board[i];
+			queued[i] = b->queue;
+			queued_tail[i] = b->queue_tail;
+			b->queue = NULL;
+			b->queue_tail = NULL;
+		}
+		dev->reflush_at = 0;
+		flush_now(dev);
+		for (i = 0; i < dev->boards; i++) {
+			b = &dev->board[i];
+			if (!queued[i]) continue;
+			if (b->queue_tail) {
+				b->queue_tail->next = queued[i];
+			} else {
+				b->queue = queued[i];
+			}
+			b->queue_tail = queued_tail[i];
+		}
+	}
+	for (i = 0; i < dev->boards; i++) {
+		pump(&dev->board[i]);
+	}
+}
+
+static int queue_request(struct board *b, struct request *r) {
+	struct nixie *dev = b->dev;
+	if (!r) {
+		give_up(dev);
+		return take_error(dev);
+	}
+	if (b->lost) {
+		/* the state is replayed once the board is back, commands are dropped */
+		free_request(r);
+		return take_error(dev);
+	}
+	if (b->queue_tail) {
+		b->queue_tail->next = r;
+	} else {
+		b->queue = r;
+	}
+	b->queue_tail = r;
+	pump(b);
+	/* wait for a free slot instead of piling up requests */
+	while (b->queue && b->in_flight >= MAX_IN_FLIGHT) {
+		run_events(dev, USB_TIMEOUT);
+	}
+	run_events(dev, 0);
+	return take_error(dev);
+}
+
+static int send_usb_msg(struct board *b, uint8_t req, uint16_t value, uint16_t index, uint8_t *buf, uint8_t l) {
+	return queue_request(b, new_request(b, req, value, index, buf, l));
+}
+
+static int recv_usb_msg(struct board *b, uint8_t req, uint16_t value, uint8_t *buf, uint8_t l) {
+	return libusb_control_transfer(b->handle,
+		LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN,
+		req,
+		value, 0,
+		buf, l,
+		USB_TIMEOUT);
+}
+
+static int send_buffer(struct board *b, uint8_t *buf, uint8_t l) {
+	return send_usb_msg(b, CUSTOM_RQ_SET_NIXIE, 0, 0, buf, l);
+}
+
+/* send a command to every board, they are queued side by side */
+static int send_all(struct nixie *dev, uint8_t *buf, uint8_t l) {
+	int failed = 0;
+	uint8_t i;
+	for (i = 0; i < dev->boards; i++) {
+		if (send_buffer(&dev->board[i], buf, l)) failed = 1;
+	}
+	return failed;
+}
+
+/* a request setting (part of) the display state */
+static int send_state(struct board *b, uint8_t req, uint16_t value, uint16_t index, uint8_t *buf, uint8_t l,
+		tube_mask tubes, tube_mask leds, uint8_t anim) {
+	struct request *r = new_request(b, req, value, index, buf, l);
+	if (r) {
+		r->resend = 0;
+		r->tubes = tubes;
+		r->leds = leds;
+		r->anim = anim;
+	}
+	return queue_request(b, r);
+}
+
+/* encode the tubes first..first+count-1 of a frame, see CUSTOM_RQ_SET_FRAME */
+static uint8_t encode_frame(uint8_t *buf, struct nixie_frame *f, uint8_t first, uint8_t count, uint8_t sections) {
+	uint8_t l = 0;
+	if (sections & CUSTOM_RQ_FRAME_TUBES) {
+		memcpy(&buf[l], &f->tube[first], count);
+		l += count;
+	}
+	if (sections & CUSTOM_RQ_FRAME_LEDS) {
+		memcpy(&buf[l], f->led[first], count*3);
+		l += count*3;
+	}
+	if (sections & CUSTOM_RQ_FRAME_ANIMATION) {
+		buf[l++] = f->anim_style;
+		buf[l++] = f->anim_speed;
+	}
+	return l;
+}
+
+/* send the tubes first..first+count-1 of the board from a frame of the display */
+static int send_frame(struct board *b, struct nixie_frame *f, uint8_t first, uint8_t count, uint8_t sections) {
+	uint8_t buf[CUSTOM_RQ_FRAME_SIZE(NIXIE_MAX_TUBES)];
+	uint8_t l = encode_frame(buf, f, b->first + first, count, sections);
+	tube_mask range = TUBE_MASK(count) << (b->first + first);
+	return send_state(b, CUSTOM_RQ_SET_FRAME, first<<8 | count, sections, buf, l,
+		(sections & CUSTOM_RQ_FRAME_TUBES) ? range : 0,
+		(sections & CUSTOM_RQ_FRAME_LEDS) ? range : 0,
+		(sections & CUSTOM_RQ_FRAME_ANIMATION) ? 1 : 0);
+}
+
+static int send_tube(struct board *b, uint8_t tube, uint8_t value) {
+	uint8_t buf[8] = {0};
+	buf[0] = CUSTOM_RQ_CONST_TUBE;
+	buf[1] = (uint8_t) tube;
+	buf[2] = (uint8_t) value;
+	return send_state(b, CUSTOM_RQ_SET_NIXIE, 0, 0, buf, sizeof(buf), (tube_mask) 1 << (b->first + tube), 0, 0);
+}
+
+static int send_led(struct board *b, uint8_t led, uint8_t *rgb) {
+	uint8_t buf[8] = {0};
+	buf[0] = CUSTOM_RQ_CONST_LED;
+	buf[1] = (uint8_t) led;
+	memcpy(&buf[2], rgb, 3);
+	return send_state(b, CUSTOM_RQ_SET_NIXIE, 0, 0, buf, sizeof(buf), 0, (tube_mask) 1 << (b->first + led), 0);
+}
+
+static int send_animation(struct board *b, uint8_t style, uint8_t speed) {
+	uint8_t buf[8] = {0};
+	buf[0] = CUSTOM_RQ_CONST_ANIMATION;
+	buf[1] = (uint8_t) 0; /* not used yet */
+	buf[2] = (uint8_t) style;
+	buf[3] = (uint8_t) speed;
+	return send_state(b, CUSTOM_RQ_SET_NIXIE, 0, 0, buf, sizeof(buf), 0, 0, 1);
+}
+
+int nixie_open(struct nixie *dev) {
+	memset(dev, 0, sizeof(*dev));
+	memset(dev->want.tube, TUBE_OFF, sizeof(dev->want.tube));
+	dev->last_refresh = time(NULL);
+	if (libusb_init(&dev->ctx) != 0) return 0;
+	if (!open_boards(dev)) {
+		libusb_exit(dev->ctx);
+		dev->ctx = NULL;
+		return 0;
+	}
+	layout(dev);
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+	    libusb_hotplug_register_callback(dev->ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+		USB_VID, USB_PID, LIBUSB_HOTPLUG_MATCH_ANY, hotplug, dev, &dev->hotplug_handle) == 0) {
+		dev->hotplug = 1;
+	}
+	nixie_sync(dev);
+	return 1;
+}
+
+/* report (and forget) whether a transfer failed for good */
+int take_error(struct nixie *dev) {
+	int failed = dev->failed;
+	dev->failed = 0;
+	return failed;
+}
+
+/* handle completed transfers and send what is due, never blocks */
+void nixie_poll(struct nixie *dev) {
+	run_events(dev, 0);
+}
+
+/* milliseconds until nixie_poll() has something to do, -1 if nothing is pending */
+int nixie_timeout(struct nixie *dev) {
+	struct timeval tv;
+	double due = 0;
+	int ms = -1;
+	uint8_t i;
+	if (dev->rescan_at) due = dev->rescan_at;
+	if (dev->reflush_at) {
+		due = dev->reflush_at;
+	} else {
+		for (i = 0; i < dev->boards; i++) {
+			struct board *b = &dev->board[i];
+			if (!b->lost && b->queue && b->in_flight < MAX_IN_FLIGHT && (!due || b->queue->due < due)) {
+				due = b->queue->due;
+			}
+			/* the failed requests come back once the board tells which ones it got */
+			if (!b->lost && b->resync && !b->in_flight) due = now();
+		}
+	}
+	if (due) {
+		ms = (due > now()) ? (int) ((due - now()) * 1000) + 1 : 0;
+	}
+	if (libusb_get_next_timeout(dev->ctx, &tv) == 1) {
+		int t = tv.tv_sec * 1000 + tv.tv_usec / 1000 + 1;
+		if (ms < 0 || t < ms) ms = t;
+	}
+	return ms;
+}
+
+static uint8_t pending(struct nixie *dev) {
+	uint8_t i;
+	if (dev->reflush_at) return 1;
+	for (i = 0; i < dev->boards; i++) {
+		struct board *b = &dev->board[i];
+		if (b->in_flight || b->queue || (b->resync && !b->lost)) return 1;
+	}
+	return 0;
+}
+
+static void drain(struct nixie *dev) {
+	int wait;
+	while (pending(dev)) {
+		wait = nixie_timeout(dev);
+		if (wait < 0 || wait > USB_TIMEOUT) wait = USB_TIMEOUT;
+		run_events(dev, wait);
+	}
+}
+
+/* wait until everything queued has been sent, a board that is still
+ * gone has not got it */
+int nixie_wait(struct nixie *dev) {
+	int failed = 0;
+	uint8_t i;
+	drain(dev);
+	for (i = 0; i < dev->boards; i++) {
+		if (dev->board[i].lost) failed = 1;
+	}
+	return take_error(dev) || failed;
+}
+
+/* the file descriptors to watch for nixie_poll() */
+int nixie_pollfds(struct nixie *dev, struct pollfd *fds, int max) {
+	const struct libusb_pollfd **usb_fds = libusb_get_pollfds(dev->ctx);
+	int n = 0;
+	if (!usb_fds) return 0;
+	for (n = 0; usb_fds[n] && n < max; n++) {
+		fds[n].fd = usb_fds[n]->fd;
+		fds[n].events = usb_fds[n]->events;
+		fds[n].revents = 0;
+	}
+	libusb_free_pollfds(usb_fds);
+	return n;
+}
+
+static int sync_info(struct board *b) {
+	struct nixie_info info;
+	memset(&info, 0, sizeof(info));
+	if (recv_usb_msg(b, CUSTOM_RQ_GET_INFO, 0, (uint8_t *) &info, sizeof(info)) < 3 ||
+	    info.tubes < 1 || info.tubes > NIXIE_MAX_TUBES) {
+		return 1;
+	}
+	b->tubes = info.tubes;
+	b->features = info.features;
+	b->features2 = info.features2;
+	b->sequence_size = info.sequence_size;
+	/* number requests on from where the board is */
+	if (b->features & NIXIE_FEATURE_SEQUENCE) {
+		b->resync = 1;
+		b->resync_seq = b->next_seq;
+	}
+	return 0;
+}
+
+static int sync_state(struct board *b) {
+	struct nixie *dev = b->dev;
+	uint8_t state[CUSTOM_RQ_STATE_SIZE(NIXIE_MAX_TUBES)];
+	uint8_t n = b->tubes;
+	if (!n) return 0;
+	if (recv_usb_msg(b, CUSTOM_RQ_GET_STATE, 0, state, CUSTOM_RQ_STATE_SIZE(n)) < CUSTOM_RQ_STATE_SIZE(n)) {
+		return 1;
+	}
+	/* the digits the tubes are set to, not the ones animated through */
+	memcpy(&dev->shown.tube[b->first], &state[n], n);
+	memcpy(dev->shown.led[b->first], &state[n*2], n*3);
+	dev->known_tubes |= BOARD_TUBES(b);
+	dev->known_leds |= BOARD_TUBES(b);
+	/* the animation is shared, boards showing another one are sent it again */
+	if (b == &dev->board[0]) {
+		dev->shown.anim_style = state[n*5];
+		dev->shown.anim_speed = state[n*5+1];
+	}
+	b->known_anim = dev->shown.anim_style == state[n*5] && dev->shown.anim_speed == state[n*5+1];
+	return 0;
+}
+
+/* ask the boards about themselves and what they show, older firmware
+ * does not know these requests and is assumed to show nothing known */
+int nixie_sync(struct nixie *dev) {
+	int failed = 0;
+	uint8_t i;
+
+	/* what we read must not be overtaken by requests still queued */
+	drain(dev);
+	for (i = 0; i < dev->boards; i++) {
+		if (!dev->board[i].lost && sync_info(&dev->board[i])) failed = 1;
+	}
+	layout(dev);
+	for (i = 0; i < dev->boards; i++) {
+		struct board *b = &dev->board[i];
+		if (!b->lost && sync_state(b)) {
+			dev->known_tubes &= ~BOARD_TUBES(b);
+			dev->known_leds &= ~BOARD_TUBES(b);
+			b->known_anim = 0;
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+/* read the firmware's counters of a board, and clear them if reset is set */
+int read_stats(struct board *b, struct nixie_stats *stats, uint8_t reset) {
+	if (b->lost || !(b->features & NIXIE_FEATURE_STATS)) return 1;
+	drain(b->dev);
+	memset(stats, 0, sizeof(*stats));
+	if (recv_usb_msg(b, CUSTOM_RQ_GET_STATS, reset, (uint8_t *) stats, sizeof(*stats)) < (int) sizeof(*stats)) {
+		return 1;
+	}
+	return 0;
+}
+
+/* learn which frame a board is at, its answer is taken to be sent
+ * halfway through the round trip of the request */
+int read_clock(struct board *b) {
+	struct nixie_clock clock;
+	double sent, done;
+	int i;
+	if (b->lost || !(b->features & NIXIE_FEATURE_CLOCK)) return 1;
+	drain(b->dev);
+	b->latency = 0;
+	for (i = 0; i < CLOCK_SAMPLES; i++) {
+		memset(&clock, 0, sizeof(clock));
+		sent = now();
+		if (recv_usb_msg(b, CUSTOM_RQ_GET_CLOCK, 0, (uint8_t *) &clock, sizeof(clock)) < (int) sizeof(clock) ||
+		    !clock.timer_khz || !clock.period) {
+			return 1;
+		}
+		done = now();
+		if (b->latency && done - sent >= b->latency) continue;
+		b->latency = done - sent;
+		b->frame_length = clock.period / (clock.timer_khz * 1000.0);
+		b->clock_frame = clock.frame;
+		b->clock_at = (sent + done) / 2 - clock.phase / (clock.timer_khz * 1000.0);
+	}
+	b->clock_synced = now();
+	return 0;
+}
+
+/* the first frame of a board starting at or after the host time t */
+static uint32_t frame_at(struct board *b, double t) {
+	double frames = (t - b->clock_at) / b->frame_length;
+	int32_t n = (int32_t) frames;
+	if (n < frames) n++;
+	return b->clock_frame + (uint32_t) n;
+}
+
+/* show the changes made since the last flush on all boards at once in
+ * delay_ms, boards without a clock show them right away */
+int nixie_flush_at(struct nixie *dev, int delay_ms) {
+	double when = now() + delay_ms / 1000.0;
+	uint8_t buf[8] = {0};
+	uint32_t frame;
+	int failed = 0;
+	uint8_t i;
+
+	if (dev->streaming) return take_error(dev);
+	for (i = 0; i < dev->boards; i++) {
+		struct board *b = &dev->board[i];
+		if ((b->features & NIXIE_FEATURE_CLOCK) && now() - b->clock_synced > CLOCK_RESYNC) read_clock(b);
+	}
+	buf[0] = CUSTOM_RQ_CONST_HOLD;
+	if (send_all(dev, buf, sizeof(buf)) || flush_now(dev)) failed = 1;
+	for (i = 0; i < dev->boards; i++) {
+		struct board *b = &dev->board[i];
+		memset(buf, 0, sizeof(buf));
+		if (b->clock_synced) {
+			frame = frame_at(b, when);
+			buf[0] = CUSTOM_RQ_CONST_COMMIT_AT;
+			buf[2] = frame & 0xff;
+			buf[3] = (frame >> 8) & 0xff;
+			buf[4] = (frame >> 16) & 0xff;
+			buf[5] = (frame >> 24) & 0xff;
+		} else {
+			buf[0] = CUSTOM_RQ_CONST_COMMIT;
+		}
+		if (send_buffer(b, buf, sizeof(buf))) failed = 1;
+	}
+	return take_error(dev) || failed;
+}
+
+void nixie_close(struct nixie *dev) {
+	uint8_t i;
+	if (dev->boards) drain(dev);
+	if (dev->hotplug) {
+		libusb_hotplug_deregister_callback(dev->ctx, dev->hotplug_handle);
+		dev->hotplug = 0;
+	}
+	for (i = 0; i < dev->boards; i++) {
+		if (!dev->board[i].handle) continue;
+		libusb_release_interface(dev->board[i].handle, 0);
+		libusb_close(dev->board[i].handle);
+	}
+	dev->boards = 0;
+	if (dev->ctx) {
+		libusb_exit(dev->ctx);
+		dev->ctx = NULL;
+	}
+}
+
+/* push the part of the wanted frame a board shows to its stream endpoint */
+static int stream_board(struct board *b, uint8_t sections) {
+	struct nixie *dev = b->dev;
+	uint8_t buf[NIXIE_STREAM_EPSIZE];
+	uint8_t l = 0;
+	struct request *r;
+	unsigned char *data;
+	buf[l++] = b->tubes;
+	buf[l++] = sections;
+	l += encode_frame(&buf[l], &dev->want, b->first, b->tubes, sections);
+
+	r = calloc(1, sizeof(*r));
+	data = malloc(l);
+	if (!r || !data || !(r->transfer = libusb_alloc_transfer(0))) {
+		free(r);
+		free(data);
+		return queue_request(b, NULL);
+	}
+	memcpy(data, buf, l);
+	libusb_fill_interrupt_transfer(r->transfer, b->handle, NIXIE_STREAM_EPNUM | LIBUSB_ENDPOINT_OUT,
+		data, l, transfer_done, r, USB_TIMEOUT);
+	r->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	r->board = b;
+	b->known_anim = dev->want_anim;
+	return queue_request(b, r);
+}
+
+int send_stream(struct nixie *dev) {
+	uint8_t sections = 0;
+	int failed = 0;
+	uint8_t i;
+	if (dev->want_tubes) sections |= CUSTOM_RQ_FRAME_TUBES;
+	if (dev->want_leds) sections |= CUSTOM_RQ_FRAME_LEDS;
+	if (dev->want_anim) sections |= CUSTOM_RQ_FRAME_ANIMATION;
+	if (!sections) return take_error(dev);
+	for (i = 0; i < dev->boards; i++) {
+		if (dev->board[i].tubes && stream_board(&dev->board[i], sections)) failed = 1;
+	}
+	/* the whole frame is on its way to the boards still there */
+	dev->shown = dev->want;
+	dev->known_tubes = dev->want_tubes;
+	dev->known_leds = dev->want_leds;
+	for (i = 0; i < dev->boards; i++) {
+		if (!dev->board[i].lost) continue;
+		dev->known_tubes &= ~BOARD_TUBES(&dev->board[i]);
+		dev->known_leds &= ~BOARD_TUBES(&dev->board[i]);
+	}
+	return failed;
+}
+
+/* the number of tubes of each board, for firmware that cannot tell */
+void set_tube_count(struct nixie *dev, uint8_t tubes) {
+	uint8_t i;
+	if (tubes < 1 || tubes > NIXIE_MAX_TUBES) return;
+	for (i = 0; i < dev->boards; i++) {
+		dev->board[i].tubes = tubes;
+	}
+	layout(dev);
+}
+
+static uint8_t tube_dirty(struct nixie *dev, uint8_t i) {
+	tube_mask m = (tube_mask) 1 << i;
+	return (dev->want_tubes & m) &&
+		(!(dev->known_tubes & m) || dev->want.tube[i] != dev->shown.tube[i]);
+}
+
+static uint8_t led_dirty(struct nixie *dev, uint8_t i) {
+	tube_mask m = (tube_mask) 1 << i;
+	return (dev->want_leds & m) &&
+		(!(dev->known_leds & m) || memcmp(dev->want.led[i], dev->shown.led[i], 3) != 0);
+}
+
+/* send each changed value of a board with a request of its own,
+ * tubes and leds are masks of the board's own tubes */
+static int send_single(struct board *b, uint8_t tubes, uint8_t leds, uint8_t anim) {
+	struct nixie *dev = b->dev;
+	uint8_t i;
+	for (i = 0; i < b->tubes; i++) {
+		uint8_t t = b->first + i;
+		if (tubes & 1<<i) {
+			dev->shown.tube[t] = dev->want.tube[t];
+			dev->known_tubes |= (tube_mask) 1 << t;
+			if (send_tube(b, i, dev->want.tube[t])) return 1;
+		}
+		if (leds & 1<<i) {
+			memcpy(dev->shown.led[t], dev->want.led[t], 3);
+			dev->known_leds |= (tube_mask) 1 << t;
+			if (send_led(b, i, dev->want.led[t])) return 1;
+		}
+	}
+	if (anim) {
+		b->known_anim = 1;
+		if (send_animation(b, dev->want.anim_style, dev->want.anim_speed)) return 1;
+	}
+	return 0;
+}
+
+/* send everything that differs from what a board is known to show */
+static int flush_board(struct board *b) {
+	struct nixie *dev = b->dev;
+	struct nixie_frame f;
+	uint8_t tubes = 0;
+	uint8_t leds = 0;
+	uint8_t anim = 0;
+	uint8_t range = 0;
+	uint8_t sections = 0;
+	uint8_t first = 0;
+	uint8_t last = 0;
+	uint8_t want_tubes = (dev->want_tubes | dev->known_tubes) >> b->first;
+	uint8_t want_leds = (dev->want_leds | dev->known_leds) >> b->first;
+	uint8_t i;
+
+	/* a lost board gets everything once it is back */
+	if (b->lost) return 0;
+
+	for (i = 0; i < b->tubes; i++) {
+		if (tube_dirty(dev, b->first + i)) tubes |= 1<<i;
+		if (led_dirty(dev, b->first + i)) leds |= 1<<i;
+	}
+	anim = dev->want_anim && (!b->known_anim ||
+		dev->want.anim_style != dev->shown.anim_style ||
+		dev->want.anim_speed != dev->shown.anim_speed);
+	if (!tubes && !leds && !anim) return 0;
+
+	/* a single frame covers the range of changed tubes, values in
+	 * between are filled in from what is already shown */
+	if (tubes || leds) {
+		while (!((tubes | leds) & 1<<first)) first++;
+		last = b->tubes-1;
+		while (!((tubes | leds) & 1<<last)) last--;
+		range = (uint8_t) ((1<<(last+1)) - (1<<first));
+	}
+	if (tubes) sections |= CUSTOM_RQ_FRAME_TUBES;
+	if (leds) sections |= CUSTOM_RQ_FRAME_LEDS;
+	if (anim) sections |= CUSTOM_RQ_FRAME_ANIMATION;
+	if ((tubes && (range & ~want_tubes)) || (leds && (range & ~want_leds))) {
+		/* a value in between is unknown and must not be touched */
+		return send_single(b, tubes, leds, anim);
+	}
+
+	f = dev->want;
+	for (i = b->first + first; i <= b->first + last && range; i++) {
+		if (!(dev->want_tubes & (tube_mask) 1 << i)) f.tube[i] = dev->shown.tube[i];
+		if (!(dev->want_leds & (tube_mask) 1 << i)) memcpy(f.led[i], dev->shown.led[i], 3);
+	}
+	/* the frame is taken as shown, a failed transfer clears that again */
+	if (tubes) {
+		memcpy(&dev->shown.tube[b->first + first], &f.tube[b->first + first], last-first+1);
+		dev->known_tubes |= (tube_mask) range << b->first;
+	}
+	if (leds) {
+		memcpy(dev->shown.led[b->first + first], f.led[b->first + first], (last-first+1)*3);
+		dev->known_leds |= (tube_mask) range << b->first;
+	}
+	if (anim) b->known_anim = 1;
+	return send_frame(b, &f, first, range ? last-first+1 : 0, sections);
+}
+
+/* the boards are flushed one after another, their transfers are
+ * on their way side by side */
+int nixie_flush(struct nixie *dev) {
+	int failed = 0;
+	uint8_t i;
+
+	if (dev->streaming || dev->batch) return take_error(dev);
+	if (dev->refresh && time(NULL) - dev->last_refresh >= dev->refresh) {
+		/* the boards might have been reset, read back what they show
+		 * or forget what we know if they cannot tell us; a flush from
+		 * within the sync must not start another one */
+		dev->last_refresh = time(NULL);
+		nixie_sync(dev);
+	}
+
+	for (i = 0; i < dev->boards; i++) {
+		if (flush_board(&dev->board[i])) failed = 1;
+	}
+	if (dev->want_anim) {
+		dev->shown.anim_style = dev->want.anim_style;
+		dev->shown.anim_speed = dev->want.anim_speed;
+	}
+	return take_error(dev) || failed;
+}
+
+/* collect the changes of several commands and send them with as few
+ * transfers as possible once the batch ends */
+int nixie_batch(struct nixie *dev, uint8_t on) {
+	dev->batch = on;
+	return on ? take_error(dev) : nixie_flush(dev);
+}
+
+int set_tube(struct nixie *dev, uint8_t tube, uint8_t value) {
+	if (tube >= dev->tubes) return 0;
+	dev->want.tube[tube] = value;
+	dev->want_tubes |= (tube_mask) 1 << tube;
+	return nixie_flush(dev);
+}
+
+int set_led(struct nixie *dev, uint8_t led, uint8_t r, uint8_t g, uint8_t b) {
+	if (led >= dev->tubes) return 0;
+	dev->want.led[led][0] = r;
+	dev->want.led[led][1] = g;
+	dev->want.led[led][2] = b;
+	dev->want_leds |= (tube_mask) 1 << led;
+	return nixie_flush(dev);
+}
+
+int set_animation(struct nixie *dev, uint8_t style, uint8_t speed) {
+	dev->want.anim_style = style;
+	dev->want.anim_speed = speed;
+	dev->want_anim = 1;
+	return nixie_flush(dev);
+}
+
+/* hold back updates on the boards until they are committed */
+int set_hold(struct nixie *dev, uint8_t on) {
+	uint8_t buf[8] = {0};
+	if (dev->streaming) {
+		/* streamed frames are always shown as a whole */
+		return 0;
+	}
+	if (dev->batch && flush_now(dev)) return 1;
+	buf[0] = on ? CUSTOM_RQ_CONST_HOLD : CUSTOM_RQ_CONST_COMMIT;
+	return send_all(dev, buf, sizeof(buf));
+}
+
+int set_number(struct nixie *dev, int number, uint8_t leading_zero) {
+	int i = 0;
+	for (i = 0; i < dev->tubes; i++) {
+		uint8_t v = number % 10;
+		if (!leading_zero && number == 0 && i != 0) v = TUBE_OFF; /* deactivate leading 0s */
+		dev->want.tube[i] = v;
+		number /= 10;
+	}
+	dev->want_tubes = ALL_TUBES(dev);
+	return nixie_flush(dev);
+}
+
+int set_color(struct nixie *dev, uint8_t r, uint8_t g, uint8_t b) {
+	int i = 0;
+	for (i = 0; i < dev->tubes; i++) {
+		dev->want.led[i][0] = r;
+		dev->want.led[i][1] = g;
+		dev->want.led[i][2] = b;
+	}
+	dev->want_leds = ALL_TUBES(dev);
+	return nixie_flush(dev);
+}
+
+/* fade one LED, or all of them with led < 0, to a color within ms on the
+ * boards themselves; the color is set at once where they cannot fade */
+int fade_led(struct nixie *dev, int led, uint8_t r, uint8_t g, uint8_t b, int ms) {
+	uint8_t buf[8] = {0};
+	int ticks = (ms+4) / 5;
+	int failed = 0;
+	uint8_t i, t;
+	if (led >= dev->tubes) return 0;
+	if (ticks > 0x7fff) ticks = 0x7fff;
+	if (dev->batch && flush_now(dev)) return 1;
+	for (t = 0; t < dev->tubes; t++) {
+		if (led >= 0 && t != led) continue;
+		dev->want.led[t][0] = r;
+		dev->want.led[t][1] = g;
+		dev->want.led[t][2] = b;
+		dev->want_leds |= (tube_mask) 1 << t;
+	}
+	buf[0] = CUSTOM_RQ_CONST_LED_FADE;
+	buf[2] = r;
+	buf[3] = g;
+	buf[4] = b;
+	buf[5] = ticks & 0xff;
+	buf[6] = ticks >> 8;
+	for (i = 0; i < dev->boards && !dev->streaming; i++) {
+		struct board *bd = &dev->board[i];
+		tube_mask m = BOARD_TUBES(bd);
+		if (led >= 0) m &= (tube_mask) 1 << led;
+		if (!m || !(bd->features & NIXIE_FEATURE_LED_FADE)) continue;
+		buf[1] = (led < 0) ? CUSTOM_RQ_LED_ALL : led - bd->first;
+		for (t = bd->first; t < bd->first + bd->tubes; t++) {
+			if (m & (tube_mask) 1 << t) memcpy(dev->shown.led[t], dev->want.led[t], 3);
+		}
+		dev->known_leds |= m;
+		if (send_state(bd, CUSTOM_RQ_SET_NIXIE, 0, 0, buf, sizeof(buf), 0, m, 0)) failed = 1;
+	}
+	return nixie_flush(dev) || failed;
+}
+
+/* a request to every board that leaves the display alone, see
+ * CUSTOM_RQ_CONST_NOP */
+int nixie_ping(struct nixie *dev) {
+	uint8_t buf[8] = {0};
+	buf[0] = CUSTOM_RQ_CONST_NOP;
+	if (dev->batch && flush_now(dev)) return 1;
+	return send_all(dev, buf, sizeof(buf));
+}
+
+int tubes_off(struct nixie *dev) {
+	memset(dev->want.tube, TUBE_OFF, sizeof(dev->want.tube));
+	dev->want_tubes = ALL_TUBES(dev);
+	return nixie_flush(dev);
+}
+
+/* upload a program for the sequencer of a board (see CUSTOM_RQ_SET_SEQUENCE),
+ * set_sequence() starts it on all boards at once */
+int send_sequence(struct board *b, uint8_t *prog, uint8_t len) {
+	uint8_t off = 0;
+	uint8_t l = 0;
+	if (b->dev->batch && flush_now(b->dev)) return 1;
+	if (!(b->features & NIXIE_FEATURE_SEQUENCER) || len > b->sequence_size) {
+		fprintf(stderr, "The sequence does not fit board %s\n", b->serial);
+		return 1;
+	}
+	for (off = 0; off < len; off += l) {
+		l = (len-off < CUSTOM_RQ_SEQUENCE_CHUNK) ? len-off : CUSTOM_RQ_SEQUENCE_CHUNK;
+		if (send_usb_msg(b, CUSTOM_RQ_SET_SEQUENCE, 0, off, &prog[off], l)) return 1;
+	}
+	return 0;
+}
+
+int set_sequence(struct nixie *dev, uint8_t on) {
+	uint8_t buf[8] = {0};
+	if (dev->batch && flush_now(dev)) return 1;
+	buf[0] = CUSTOM_RQ_CONST_SEQUENCE;
+	buf[1] = on;
+	if (on) {
+		/* the display belongs to the sequencer now */
+		dev->want_tubes = 0;
+		dev->want_leds = 0;
+		dev->known_tubes = 0;
+		dev->known_leds = 0;
+	}
+	return send_all(dev, buf, sizeof(buf));
+}
+
+/* let the first board count by itself every period_ms, 0 stops the counter;
+ * the boards cannot carry over into each other, so the tubes of the
+ * other boards are turned off */
+int set_counter(struct nixie *dev, uint8_t flags, uint32_t value, int period_ms) {
+	struct board *b = &dev->board[0];
+	uint8_t buf[8] = {0};
+	uint8_t i;
+	int period = (period_ms+4) / 5;
+	if (period_ms > 0 && period < 1) period = 1;
+	if (period > 0xffff) period = 0xffff;
+	if (dev->batch && flush_now(dev)) return 1;
+	buf[0] = CUSTOM_RQ_CONST_COUNTER;
+	buf[1] = flags;
+	buf[2] = value & 0xff;
+	buf[3] = (value >> 8) & 0xff;
+	buf[4] = (value >> 16) & 0xff;
+	buf[5] = (value >> 24) & 0xff;
+	buf[6] = period & 0xff;
+	buf[7] = period >> 8;
+	/* the tubes belong to the counter now */
+	dev->want_tubes &= ~BOARD_TUBES(b);
+	dev->known_tubes &= ~BOARD_TUBES(b);
+	if (period) {
+		for (i = 0; i < dev->tubes; i++) {
+			if (BOARD_TUBES(b) & (tube_mask) 1 << i) continue;
+			dev->want.tube[i] = TUBE_OFF;
+			dev->want_tubes |= (tube_mask) 1 << i;
+		}
+	}
+	return send_buffer(b, buf, sizeof(buf)) || nixie_flush(dev);
+}
+
+/* light each tube rate times per second (0 for the default of the
+ * firmware), keeping all tubes off for blank_us while the digit changes */
+int set_mux(struct nixie *dev, int rate, int blank_us) {
+	uint8_t buf[8] = {0};
+	int failed = 0;
+	uint8_t i;
+	if (rate > 0xffff) rate = 0xffff;
+	if (blank_us > 0xffff) blank_us = 0xffff;
+	if (dev->batch && flush_now(dev)) return 1;
+	buf[0] = CUSTOM_RQ_CONST_MUX;
+	buf[2] = rate & 0xff;
+	buf[3] = rate >> 8;
+	buf[4] = blank_us & 0xff;
+	buf[5] = blank_us >> 8;
+	dev->mux_set = 1;
+	dev->mux_rate = rate;
+	dev->mux_blank = blank_us;
+	for (i = 0; i < dev->boards; i++) {
+		struct board *b = &dev->board[i];
+		if (!(b->features2 & NIXIE_FEATURE2_MUX)) {
+			fprintf(stderr, "Board %s has a fixed multiplex rate\n", b->serial);
+			failed = 1;
+		} else if (send_buffer(b, buf, sizeof(buf))) {
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+/* light a tube (all of them for -1) for percent of its multiplex slot */
+int set_brightness(struct nixie *dev, int tube, int percent) {
+	uint8_t buf[8] = {0};
+	int failed = 0;
+	uint8_t i;
+	if (tube >= dev->tubes) return 0;
+	if (percent > 100) percent = 100;
+	if (dev->batch && flush_now(dev)) return 1;
+	buf[0] = CUSTOM_RQ_CONST_BRIGHTNESS;
+	buf[2] = percent;
+	for (i = 0; i < dev->tubes; i++) {
+		if (tube >= 0 && i != tube) continue;
+		dev->brightness[i] = percent;
+		dev->dimmed |= (tube_mask) 1 << i;
+	}
+	for (i = 0; i < dev->boards; i++) {
+		struct board *b = &dev->board[i];
+		if (tube >= 0 && (tube < b->first || tube >= b->first + b->tubes)) continue;
+		buf[1] = (tube < 0) ? CUSTOM_RQ_TUBE_ALL : tube - b->first;
+		if (!(b->features2 & NIXIE_FEATURE2_MUX)) {
+			fprintf(stderr, "Board %s cannot dim its tubes\n", b->serial);
+			failed = 1;
+		} else if (send_buffer(b, buf, sizeof(buf))) {
+			failed = 1;
+		}
+	}
+	return failed;
+}
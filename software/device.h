@@ -0,0 +1,163 @@
+/*
+ * device.h
+ *
+ * USB access to the nixie display, shared by nixie and nixied
+ */
+
+#ifndef __DEVICE_H_INCLUDED__
+#define __DEVICE_H_INCLUDED__
+
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <libusb.h>
+#include "../firmware/requests.h"
+
+#define V_NAME "Wertarbyte.de"
+#define P_NAME "Nixie"
+
+#define TUBE_OFF 11
+
+/* tubes assumed until told otherwise */
+#define DEFAULT_TUBES 3
+
+/* boards opened as one display and the tubes they add up to */
+#define MAX_BOARDS 8
+#define MAX_TUBES 32
+/* serial numbers of the boards, one per line, starting with the board
+ * showing the last digits; $NIXIE_CONFIG overrides the path */
+#define DEFAULT_CONFIG "/etc/nixie.conf"
+
+/* one bit per tube of the whole display */
+typedef uint32_t tube_mask;
+
+/* host side copy of a display frame, see CUSTOM_RQ_SET_FRAME */
+struct nixie_frame {
+	uint8_t tube[MAX_TUBES];
+	uint8_t led[MAX_TUBES][3];
+	uint8_t anim_style;
+	uint8_t anim_speed;
+};
+
+struct request;
+struct nixie;
+
+/* a device showing the tubes first..first+tubes-1 of the display */
+struct board {
+	struct nixie *dev;
+	/* NULL once a board that went away is closed */
+	libusb_device_handle *handle;
+	char serial[64];
+	/* the board went away, what it showed is replayed when it is back */
+	uint8_t lost;
+	uint8_t first;
+	/* number of tubes on the board and its NIXIE_FEATURE_ and NIXIE_FEATURE2_ flags */
+	uint8_t tubes;
+	uint8_t features;
+	uint8_t features2;
+	/* room for sequencer programs on the board */
+	uint8_t sequence_size;
+	/* the board shows the animation in dev->shown */
+	uint8_t known_anim;
+	/* the board was at clock_frame at host time clock_at, as read at
+	 * clock_synced (0 if not yet, see read_clock()); the round trip of
+	 * that request and the length of a frame in seconds */
+	uint32_t clock_frame;
+	double clock_at;
+	double clock_synced;
+	double latency;
+	double frame_length;
+	/* the number of the next request to the board (NIXIE_FEATURE_SEQUENCE),
+	 * and whether to ask it which ones it got before sending more, taking
+	 * resync_seq to be the first one missing if it cannot tell */
+	uint8_t next_seq;
+	uint8_t resync;
+	uint8_t resync_seq;
+	/* numbered requests that failed, in order, waiting for the board to tell */
+	struct request *failed;
+	/* requests submitted and not completed yet */
+	int in_flight;
+	/* requests waiting to be submitted, in order */
+	struct request *queue;
+	struct request *queue_tail;
+};
+
+struct nixie {
+	libusb_context *ctx;
+	struct board board[MAX_BOARDS];
+	uint8_t boards;
+	/* libusb tells us about boards coming and going */
+	uint8_t hotplug;
+	libusb_hotplug_callback_handle hotplug_handle;
+	/* when to look for lost boards again, 0 if none is lost */
+	double rescan_at;
+	/* when to flush the state again after a failed request, 0 if not scheduled */
+	double reflush_at;
+	int state_failures;
+	/* a request could not be sent, see take_error() */
+	uint8_t failed;
+	/* number of tubes of all boards and the NIXIE_FEATURE_ flags they share */
+	uint8_t tubes;
+	uint8_t features;
+	/* the state built up by commands */
+	struct nixie_frame want;
+	/* what the boards are known to show */
+	struct nixie_frame shown;
+	/* bitmasks of the tubes/LEDs holding a wanted or known value */
+	tube_mask want_tubes;
+	tube_mask want_leds;
+	tube_mask known_tubes;
+	tube_mask known_leds;
+	uint8_t want_anim;
+	/* the multiplex rate and brightness last set, sent again to boards
+	 * that come back (see set_mux() and set_brightness()) */
+	uint8_t mux_set;
+	uint16_t mux_rate;
+	uint16_t mux_blank;
+	tube_mask dimmed;
+	uint8_t brightness[MAX_TUBES];
+	/* seconds after which everything is sent again, 0 to disable */
+	int refresh;
+	time_t last_refresh;
+	/* the wanted state is pushed by send_stream() instead of being flushed */
+	uint8_t streaming;
+	/* changes are collected and flushed at the end of a batch, see nixie_batch() */
+	uint8_t batch;
+	/* transfers submitted and failed transfers sent again, for nixie-bench */
+	unsigned long transfers;
+	unsigned long retries;
+};
+
+int nixie_open(struct nixie *dev);
+void nixie_close(struct nixie *dev);
+int nixie_flush(struct nixie *dev);
+int nixie_batch(struct nixie *dev, uint8_t on);
+int nixie_wait(struct nixie *dev);
+void nixie_poll(struct nixie *dev);
+int nixie_timeout(struct nixie *dev);
+int nixie_pollfds(struct nixie *dev, struct pollfd *fds, int max);
+int take_error(struct nixie *dev);
+int nixie_sync(struct nixie *dev);
+void set_tube_count(struct nixie *dev, uint8_t tubes);
+int read_stats(struct board *b, struct nixie_stats *stats, uint8_t reset);
+int read_clock(struct board *b);
+int nixie_flush_at(struct nixie *dev, int delay_ms);
+int nixie_ping(struct nixie *dev);
+
+int set_tube(struct nixie *dev, uint8_t tube, uint8_t value);
+int set_led(struct nixie *dev, uint8_t led, uint8_t r, uint8_t g, uint8_t b);
+int set_animation(struct nixie *dev, uint8_t style, uint8_t speed);
+int set_hold(struct nixie *dev, uint8_t on);
+int set_number(struct nixie *dev, int number, uint8_t leading_zero);
+int set_color(struct nixie *dev, uint8_t r, uint8_t g, uint8_t b);
+int fade_led(struct nixie *dev, int led, uint8_t r, uint8_t g, uint8_t b, int ms);
+int tubes_off(struct nixie *dev);
+int send_sequence(struct board *b, uint8_t *prog, uint8_t len);
+int set_sequence(struct nixie *dev, uint8_t on);
+int set_counter(struct nixie *dev, uint8_t flags, uint32_t value, int period_ms);
+int set_mux(struct nixie *dev, int rate, int blank_us);
+int set_brightness(struct nixie *dev, int tube, int percent);
+
+int send_stream(struct nixie *dev);
+
+#endif /* __DEVICE_H_INCLUDED__ */
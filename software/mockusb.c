@@ -0,0 +1,288 @@
+/*
+ * mockusb.c
+ *
+ * An in-process stand-in for the parts of libusb-1.0 used by device.c,
+ * linked instead of libusb into nixie-bench-mock. The boards accept
+ * every request after a fixed latency, one after another, like the
+ * firmware working through its request queue:
+ *
+ *   NIXIE_MOCK_BOARDS      number of boards (1)
+ *   NIXIE_MOCK_TUBES       tubes per board (3)
+ *   NIXIE_MOCK_LATENCY_US  time a board takes per request (1000)
+ *   NIXIE_MOCK_FAIL        percentage of requests that stall (0), half
+ *                          of them after the board got them
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "device.h"
+
+#define MOCK_MAX_BOARDS 8
+#define MOCK_MAX_PENDING 256
+/* control requests the firmware queues, more are stalled */
+#define MOCK_QUEUE 3
+
+struct libusb_context {
+	int boards;
+	int tubes;
+	double latency;
+	double fail;
+};
+
+struct libusb_device {
+	int n;
+	/* control requests not completed yet */
+	int queued;
+	/* number of the last request received */
+	uint8_t received;
+	/* when the board is done with the requests sent so far */
+	double busy_until;
+};
+
+struct libusb_device_handle {
+	libusb_device *dev;
+};
+
+struct pending {
+	struct libusb_transfer *transfer;
+	double done;
+};
+
+static struct libusb_context mock;
+static libusb_device boards[MOCK_MAX_BOARDS];
+static libusb_device *board_list[MOCK_MAX_BOARDS+1];
+/* transfers in the order they complete */
+static struct pending pending[MOCK_MAX_PENDING];
+static int n_pending;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t) {
+	double wait = t - now();
+	struct timespec ts;
+	if (wait <= 0) return;
+	ts.tv_sec = (time_t) wait;
+	ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+}
+
+static double env(const char *name, double def) {
+	const char *v = getenv(name);
+	return v ? atof(v) : def;
+}
+
+int libusb_init(libusb_context **ctx) {
+	int i;
+	mock.boards = (int) env("NIXIE_MOCK_BOARDS", 1);
+	mock.tubes = (int) env("NIXIE_MOCK_TUBES", 3);
+	mock.latency = env("NIXIE_MOCK_LATENCY_US", 1000) / 1e6;
+	mock.fail = env("NIXIE_MOCK_FAIL", 0) / 100;
+	if (mock.boards < 1 || mock.boards > MOCK_MAX_BOARDS) mock.boards = 1;
+	if (mock.tubes < 1 || mock.tubes > NIXIE_MAX_TUBES) mock.tubes = 3;
+	for (i = 0; i < mock.boards; i++) {
+		memset(&boards[i], 0, sizeof(boards[i]));
+		boards[i].n = i;
+		board_list[i] = &boards[i];
+	}
+	board_list[i] = NULL;
+	n_pending = 0;
+	*ctx = &mock;
+	return 0;
+}
+
+void libusb_exit(libusb_context *ctx) {
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+	*list = board_list;
+	return ctx->boards;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices) {
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+	memset(desc, 0, sizeof(*desc));
+	desc->idVendor = USB_VID;
+	desc->idProduct = USB_PID;
+	desc->iManufacturer = 1;
+	desc->iProduct = 2;
+	desc->iSerialNumber = 3;
+	return 0;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle) {
+	*handle = calloc(1, sizeof(**handle));
+	if (!*handle) return LIBUSB_ERROR_NO_MEM;
+	(*handle)->dev = dev;
+	return 0;
+}
+
+void libusb_close(libusb_device_handle *handle) {
+	free(handle);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *handle) {
+	return handle->dev;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *handle, uint8_t index, unsigned char *data, int length) {
+	switch (index) {
+		case 1:
+			return snprintf((char *) data, length, "%s", V_NAME);
+		case 2:
+			return snprintf((char *) data, length, "%s", P_NAME);
+		case 3:
+			return snprintf((char *) data, length, "MOCK%02d", handle->dev->n);
+	}
+	return LIBUSB_ERROR_INVALID_PARAM;
+}
+
+int libusb_claim_interface(libusb_device_handle *handle, int interface_number) {
+	return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *handle, int interface_number) {
+	return 0;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+	return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer) {
+	if (!transfer) return;
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) free(transfer->buffer);
+	free(transfer);
+}
+
+/* take the number of a request like the firmware does, returns 0 if
+ * it skips one */
+static int receive(libusb_device *dev, struct libusb_transfer *transfer) {
+	uint8_t seq = transfer->buffer[5];
+	uint8_t ahead = (seq - dev->received) & CUSTOM_RQ_SEQ_MASK;
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL || !(seq & CUSTOM_RQ_SEQ_FLAG)) return 1;
+	if (ahead == 0 || ahead >= CUSTOM_RQ_SEQ_MASK+1 - CUSTOM_RQ_SEQ_WINDOW) return 1;
+	if (ahead != 1) return 0;
+	dev->received = seq & CUSTOM_RQ_SEQ_MASK;
+	return 1;
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer) {
+	libusb_device *dev = transfer->dev_handle->dev;
+	double start = now();
+	int i;
+	if (n_pending == MOCK_MAX_PENDING) return LIBUSB_ERROR_BUSY;
+	if (dev->busy_until > start) start = dev->busy_until;
+	dev->busy_until = start + mock.latency;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL && ++dev->queued > MOCK_QUEUE) {
+		transfer->status = LIBUSB_TRANSFER_STALL;
+	} else if (mock.fail > 0 && rand() < mock.fail * RAND_MAX) {
+		transfer->status = LIBUSB_TRANSFER_STALL;
+		if (rand() & 1) receive(dev, transfer);
+	} else if (receive(dev, transfer)) {
+		transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	} else {
+		transfer->status = LIBUSB_TRANSFER_STALL;
+	}
+	/* keep the transfers ordered by the time they complete */
+	for (i = n_pending; i > 0 && pending[i-1].done > dev->busy_until; i--) {
+		pending[i] = pending[i-1];
+	}
+	pending[i].transfer = transfer;
+	pending[i].done = dev->busy_until;
+	n_pending++;
+	return 0;
+}
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv) {
+	double deadline = now() + tv->tv_sec + tv->tv_usec / 1e6;
+	struct libusb_transfer *t;
+	if (n_pending && pending[0].done < deadline) deadline = pending[0].done;
+	sleep_until(deadline);
+	while (n_pending && pending[0].done <= now()) {
+		t = pending[0].transfer;
+		memmove(&pending[0], &pending[1], --n_pending * sizeof(pending[0]));
+		if (t->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+			t->dev_handle->dev->queued--;
+			t->actual_length = t->length - LIBUSB_CONTROL_SETUP_SIZE;
+		} else {
+			t->actual_length = t->length;
+		}
+		if (t->status != LIBUSB_TRANSFER_COMPLETED) t->actual_length = 0;
+		t->callback(t);
+	}
+	return 0;
+}
+
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv) {
+	double wait;
+	if (!n_pending) return 0;
+	wait = pending[0].done - now();
+	if (wait < 0) wait = 0;
+	tv->tv_sec = (time_t) wait;
+	tv->tv_usec = (suseconds_t) ((wait - tv->tv_sec) * 1e6);
+	return 1;
+}
+
+int libusb_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t request,
+		uint16_t value, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout) {
+	libusb_device *dev = handle->dev;
+	struct nixie_info info;
+	sleep_until(dev->busy_until);
+	sleep_until(now() + mock.latency);
+	memset(data, 0, length);
+	if (request == CUSTOM_RQ_GET_INFO) {
+		memset(&info, 0, sizeof(info));
+		info.version = NIXIE_PROTOCOL_VERSION;
+		info.tubes = mock.tubes;
+		info.features = 0xff;
+		info.features2 = NIXIE_FEATURE2_MUX;
+		info.led_pwm_bits = 6;
+		info.sequence_size = 64;
+		if (length > sizeof(info)) length = sizeof(info);
+		memcpy(data, &info, length);
+		return length;
+	} else if (request == CUSTOM_RQ_GET_ACK) {
+		/* requests are applied as soon as they are received */
+		data[0] = dev->received;
+		if (length > 1) data[1] = dev->received;
+		return length < sizeof(struct nixie_ack) ? length : sizeof(struct nixie_ack);
+	} else if (request == CUSTOM_RQ_GET_STATE) {
+		/* all tubes off */
+		memset(data, TUBE_OFF, mock.tubes*2 < length ? mock.tubes*2 : length);
+		return length;
+	}
+	return LIBUSB_ERROR_PIPE;
+}
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx) {
+	/* nothing to watch, nixie_timeout() tells when transfers complete */
+	return calloc(1, sizeof(struct libusb_pollfd *));
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds) {
+	free((void *) pollfds);
+}
+
+int libusb_has_capability(uint32_t capability) {
+	return 0;
+}
+
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id,
+		int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data,
+		libusb_hotplug_callback_handle *callback_handle) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void libusb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle) {
+}
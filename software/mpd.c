@@ -0,0 +1,369 @@
+/*
+ * mpd.c
+ *
+ * Shows what mpd is playing, like contrib/mpd2nixie does, without
+ * polling: mpd's idle command wakes us when the player or the mixer
+ * changes, the time left is counted down locally in between.
+ * With -h -, mpd is talked to over stdin and stdout (see test-mpd.sh).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "device.h"
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT "6600"
+/* seconds a new volume or track is shown before the time left */
+#define NOTICE_TIME 2.5
+/* seconds to wait before connecting to mpd again */
+#define RECONNECT 5
+/* file descriptors libusb may ask us to watch */
+#define MAX_USB_FDS 8
+#define MAX_LINE 1024
+
+enum notice { NOTICE_NONE, NOTICE_VOLUME, NOTICE_TRACK };
+
+struct player {
+	char state[16];
+	int volume;
+	int song;
+	/* seconds played when the status was read, and the length of the song, 0 if unknown */
+	double elapsed;
+	double duration;
+	double at;
+	/* what to show instead of the time left, and until when */
+	enum notice notice;
+	double notice_until;
+};
+
+/* the reply mpd is expected to send next */
+enum mpd_state { MPD_GREETING, MPD_PASSWORD, MPD_STATUS, MPD_IDLE };
+
+struct mpd {
+	/* replies are read from fd and commands written to out, both are
+	 * the socket unless talking over stdin and stdout */
+	int fd;
+	int out;
+	/* MPD_HOST may be password@host */
+	const char *host;
+	enum mpd_state state;
+	/* the status being read, and whether it is the first since connecting */
+	struct player status;
+	uint8_t first;
+	size_t fill;
+	char buf[MAX_LINE];
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig) {
+	running = 0;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* connect to mpd on host:port, or to its unix socket if host is a path,
+ * - talks to it over stdin and stdout */
+static int mpd_connect(struct mpd *m, const char *host, const char *port) {
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un addr;
+	m->fd = -1;
+	m->fill = 0;
+	if (strcmp(host, "-") == 0) {
+		m->fd = STDIN_FILENO;
+		m->out = STDOUT_FILENO;
+		return 0;
+	}
+	if (host[0] == '/') {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, host, sizeof(addr.sun_path)-1);
+		m->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (m->fd >= 0 && connect(m->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			close(m->fd);
+			m->fd = -1;
+		}
+		m->out = m->fd;
+		return m->fd < 0;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0) return 1;
+	for (ai = res; ai && m->fd < 0; ai = ai->ai_next) {
+		m->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (m->fd >= 0 && connect(m->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+			close(m->fd);
+			m->fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	m->out = m->fd;
+	return m->fd < 0;
+}
+
+static void mpd_close(struct mpd *m) {
+	if (m->fd > STDIN_FILENO) close(m->fd);
+	m->fd = -1;
+}
+
+static int send_cmd(struct mpd *m, const char *cmd) {
+	size_t len = strlen(cmd);
+	return write(m->out, cmd, len) != (ssize_t) len;
+}
+
+/* store a field of a status reply */
+static void parse_status(struct player *p, char *line) {
+	char *value = strstr(line, ": ");
+	if (!value) return;
+	*value = '\0';
+	value += 2;
+	if (strcmp(line, "state") == 0) {
+		strncpy(p->state, value, sizeof(p->state)-1);
+	} else if (strcmp(line, "volume") == 0) {
+		p->volume = atoi(value);
+	} else if (strcmp(line, "song") == 0) {
+		p->song = atoi(value);
+	} else if (strcmp(line, "elapsed") == 0) {
+		p->elapsed = atof(value);
+	} else if (strcmp(line, "duration") == 0) {
+		p->duration = atof(value);
+	} else if (strcmp(line, "time") == 0 && p->duration == 0) {
+		/* older servers only tell elapsed:total in whole seconds */
+		if ((value = strchr(value, ':'))) p->duration = atof(value+1);
+	}
+}
+
+static int ask_status(struct mpd *m) {
+	memset(&m->status, 0, sizeof(m->status));
+	m->status.volume = -1;
+	m->status.song = -1;
+	m->state = MPD_STATUS;
+	return send_cmd(m, "status\n");
+}
+
+/* take the status read, a new volume or track is shown for a while */
+static void take_status(struct player *p, struct player *s, uint8_t notify) {
+	struct player old = *p;
+	memcpy(p->state, s->state, sizeof(p->state));
+	p->volume = s->volume;
+	p->song = s->song;
+	p->elapsed = s->elapsed;
+	p->duration = s->duration;
+	p->at = now();
+	if (!notify) return;
+	if (p->volume != old.volume && p->volume >= 0) {
+		p->notice = NOTICE_VOLUME;
+		p->notice_until = p->at + NOTICE_TIME;
+	} else if (p->song != old.song && p->song >= 0) {
+		p->notice = NOTICE_TRACK;
+		p->notice_until = p->at + NOTICE_TIME;
+	}
+}
+
+/* handle a line sent by mpd: after the greeting the status is read,
+ * then we wait for the player or the mixer to change and read it again */
+static int mpd_line(struct mpd *m, struct player *p, char *line) {
+	char cmd[MAX_LINE];
+	char *at;
+	if (m->state == MPD_GREETING) {
+		if (strncmp(line, "OK MPD ", 7) != 0) return 1;
+		if ((at = strrchr(m->host, '@'))) {
+			snprintf(cmd, sizeof(cmd), "password %.*s\n", (int) (at - m->host), m->host);
+			m->state = MPD_PASSWORD;
+			return send_cmd(m, cmd);
+		}
+		return ask_status(m);
+	}
+	if (strncmp(line, "ACK ", 4) == 0) {
+		fprintf(stderr, "mpd: %s\n", line);
+		return 1;
+	}
+	if (strcmp(line, "OK") != 0) {
+		/* idle only tells what changed, the status is read again anyway */
+		if (m->state == MPD_STATUS) parse_status(&m->status, line);
+		return 0;
+	}
+	if (m->state == MPD_STATUS) {
+		take_status(p, &m->status, !m->first);
+		m->first = 0;
+		m->state = MPD_IDLE;
+		return send_cmd(m, "idle player mixer\n");
+	}
+	/* the password was taken, or something changed */
+	return ask_status(m);
+}
+
+/* handle whatever mpd sent, without waiting for the rest of a line */
+static int mpd_read(struct mpd *m, struct player *p) {
+	char *start, *nl;
+	ssize_t n;
+	for (;;) {
+		n = read(m->fd, m->buf + m->fill, sizeof(m->buf) - m->fill);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if (n <= 0) return 1;
+		m->fill += n;
+		start = m->buf;
+		while ((nl = memchr(start, '\n', m->buf + m->fill - start))) {
+			*nl = '\0';
+			if (mpd_line(m, p, start)) return 1;
+			start = nl+1;
+		}
+		m->fill -= start - m->buf;
+		memmove(m->buf, start, m->fill);
+		if (m->fill == sizeof(m->buf)) return 1;
+	}
+}
+
+/* connect, mpd is talked to from the poll loop from then on */
+static int mpd_start(struct mpd *m, const char *host, const char *port) {
+	char *at = strrchr(host, '@');
+	m->host = host;
+	m->state = MPD_GREETING;
+	m->first = 1;
+	if (mpd_connect(m, at ? at+1 : host, port)) return 1;
+	/* reading must never hold up the display */
+	return fcntl(m->fd, F_SETFL, fcntl(m->fd, F_GETFL) | O_NONBLOCK) < 0;
+}
+
+/* show the player on the display, returns the seconds until what is
+ * shown changes by itself, -1 if it does not */
+static double show_player(struct nixie *dev, struct player *p, uint8_t show_paused) {
+	double t = now();
+	double wait = -1;
+	double played;
+	uint8_t playing = strcmp(p->state, "play") == 0;
+
+	nixie_batch(dev, 1);
+	if (p->notice != NOTICE_NONE && t < p->notice_until) {
+		if (p->notice == NOTICE_VOLUME) {
+			set_color(dev, 255, 0, 0);
+			set_number(dev, p->volume, 1);
+		} else {
+			set_color(dev, 0, 255, 0);
+			set_number(dev, p->song, 0);
+		}
+		wait = p->notice_until - t;
+	} else if (playing || (show_paused && strcmp(p->state, "pause") == 0)) {
+		played = p->elapsed + (playing ? t - p->at : 0);
+		set_color(dev, 0, 255, 128);
+		if (p->duration > 0) {
+			double left = (played < p->duration) ? p->duration - played : 0;
+			set_number(dev, (int) left, 1);
+			/* until the next whole second is passed */
+			if (playing && left > 0) wait = left - floor(left) + 0.001;
+		} else {
+			/* streams have no end to count down to */
+			set_number(dev, (int) played, 1);
+			if (playing) wait = ceil(played) - played + 0.001;
+		}
+	} else {
+		tubes_off(dev);
+		set_color(dev, 0, 0, 0);
+	}
+	nixie_batch(dev, 0);
+	return wait;
+}
+
+int main(int argc, char *argv[]) {
+	struct nixie dev;
+	struct mpd m = { .fd = -1 };
+	struct player p;
+	const char *host = getenv("MPD_HOST") ? getenv("MPD_HOST") : DEFAULT_HOST;
+	const char *port = getenv("MPD_PORT") ? getenv("MPD_PORT") : DEFAULT_PORT;
+	uint8_t show_paused = 0;
+	struct pollfd fds[1+MAX_USB_FDS];
+	double reconnect_at = 0;
+	double wait;
+	int timeout;
+	int usb_timeout;
+	int n_usb;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h:p:P")) != -1) {
+		switch (opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'P':
+				show_paused = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-P] [-h host] [-p port]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (!nixie_open(&dev)) {
+		perror("Unable to open usb device");
+		return 1;
+	}
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+	memset(&p, 0, sizeof(p));
+
+	while (running) {
+		if (m.fd < 0 && now() >= reconnect_at && mpd_start(&m, host, port)) {
+			fprintf(stderr, "Unable to talk to mpd at %s, retrying in %u seconds\n", host, RECONNECT);
+			mpd_close(&m);
+			reconnect_at = now() + RECONNECT;
+		}
+		wait = show_player(&dev, &p, show_paused);
+		if (m.fd < 0) wait = reconnect_at - now();
+
+		fds[0].fd = m.fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		n_usb = nixie_pollfds(&dev, &fds[1], MAX_USB_FDS);
+		timeout = (wait >= 0) ? (int) ceil(wait * 1000) : -1;
+		usb_timeout = nixie_timeout(&dev);
+		if (usb_timeout >= 0 && (timeout < 0 || usb_timeout < timeout)) timeout = usb_timeout;
+		if (poll(fds, 1+n_usb, timeout) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+		nixie_poll(&dev);
+		if (m.fd >= 0 && fds[0].revents && mpd_read(&m, &p)) {
+			if (m.first) {
+				fprintf(stderr, "Unable to talk to mpd at %s, retrying in %u seconds\n", host, RECONNECT);
+			} else {
+				fprintf(stderr, "Lost the connection to mpd\n");
+			}
+			mpd_close(&m);
+			memset(&p, 0, sizeof(p));
+			reconnect_at = now() + RECONNECT;
+			/* stdin cannot be connected to again */
+			if (strcmp(host, "-") == 0) running = 0;
+		}
+	}
+
+	mpd_close(&m);
+	tubes_off(&dev);
+	set_color(&dev, 0, 0, 0);
+	nixie_wait(&dev);
+	nixie_close(&dev);
+	return 0;
+}
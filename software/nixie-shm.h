@@ -0,0 +1,83 @@
+/*
+ * nixie-shm.h
+ *
+ * The framebuffer nixied -m shares in /dev/shm: clients draw digits and
+ * colors into a layer of their own, nixied shows the topmost value set
+ * for each tube. Clients only need this header, e.g.:
+ *
+ *   struct nixie_shm *fb = nixie_shm_open();
+ *   struct nixie_shm_layer *l = &fb->layer[1];
+ *   nixie_shm_begin(l);
+ *   l->tube[0] = 7;
+ *   l->tubes |= 1 << 0;
+ *   nixie_shm_end(l);
+ *
+ * A layer has a single writer at a time, which keeps its updates short
+ * and never blocks between nixie_shm_begin() and nixie_shm_end(). An
+ * update not ended within NIXIE_SHM_STALE_MS is taken to be left behind
+ * by a client that died: nixied shows the layer as it is, and the next
+ * nixie_shm_begin() on it starts over.
+ */
+
+#ifndef __NIXIE_SHM_H_INCLUDED__
+#define __NIXIE_SHM_H_INCLUDED__
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define NIXIE_SHM_NAME "/nixie"
+#define NIXIE_SHM_MAGIC 0x4e495846
+#define NIXIE_SHM_VERSION 1
+/* layers from the bottom up and the tubes of each */
+#define NIXIE_SHM_LAYERS 4
+#define NIXIE_SHM_TUBES 32
+#define NIXIE_SHM_STALE_MS 1000
+
+struct nixie_shm_layer {
+	/* odd while a client updates the layer, see nixie_shm_begin() */
+	uint32_t seq;
+	/* one bit per tube (LED) the layer sets, the others show the layers below */
+	uint32_t tubes;
+	uint32_t leds;
+	uint8_t tube[NIXIE_SHM_TUBES];
+	uint8_t led[NIXIE_SHM_TUBES][3];
+};
+
+struct nixie_shm {
+	uint32_t magic;
+	uint32_t version;
+	/* tubes of the display, kept up to date by nixied */
+	uint32_t display_tubes;
+	struct nixie_shm_layer layer[NIXIE_SHM_LAYERS];
+};
+
+/* map the framebuffer of a running nixied, NULL if there is none */
+static inline struct nixie_shm *nixie_shm_open(void) {
+	struct nixie_shm *fb;
+	int fd = shm_open(NIXIE_SHM_NAME, O_RDWR, 0);
+	if (fd < 0) return NULL;
+	fb = mmap(NULL, sizeof(*fb), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (fb == MAP_FAILED) return NULL;
+	if (fb->magic != NIXIE_SHM_MAGIC || fb->version != NIXIE_SHM_VERSION) {
+		munmap(fb, sizeof(*fb));
+		return NULL;
+	}
+	return fb;
+}
+
+/* an update of a layer starts with nixie_shm_begin() and ends with
+ * nixie_shm_end(), nixied never shows half of it */
+static inline void nixie_shm_begin(struct nixie_shm_layer *l) {
+	/* odd even if the last update was never ended */
+	__atomic_store_n(&l->seq, (l->seq + 1) | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void nixie_shm_end(struct nixie_shm_layer *l) {
+	__atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* __NIXIE_SHM_H_INCLUDED__ */
@@ -6,200 +6,179 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
-#include <usb.h>
-#include "../firmware/requests.h"
-
-#define V_NAME "Wertarbyte.de"
-#define P_NAME "Nixie"
-
-#define TUBE_OFF 11
-
-#define MAX_DIGITS 3
-
-uint8_t open_usb(usb_dev_handle **handle) {
-	uint16_t vid = USB_VID;
-	uint16_t pid = USB_PID;
-	char vendor[256];
-	char product[256];
-	struct usb_bus *bus;
-	struct usb_device *dev;
-	usb_dev_handle *target = NULL;
-
-	usb_init();
-	usb_find_busses();
-	usb_find_devices();
-	for (bus=usb_get_busses(); bus; bus=bus->next) {
-		for (dev=bus->devices; dev; dev=dev->next) {
-			if (dev->descriptor.idVendor == vid && dev->descriptor.idProduct == pid) {
-				target = usb_open(dev);
-				if (target) {
-					usb_get_string_simple(target, dev->descriptor.iManufacturer, vendor, sizeof(vendor));
-					usb_get_string_simple(target, dev->descriptor.iProduct, product, sizeof(product));
-					if (strcmp(vendor, V_NAME) == 0 && strcmp(product, P_NAME) == 0) {
-						/* we found our device */
-						break;
-					}
-				}
-				usb_close(target);
-				target = NULL;
+#include "device.h"
+#include "command.h"
+
+/* input read at once and sent as one batch */
+#define READ_BUF 65536
+
+static int run_command(struct nixie *dev, char *cmd);
+
+/* commands read by a single read() are collected into one batch,
+ * a whole batch can be sent with a single transfer per board */
+static int read_batched(struct nixie *dev, uint8_t autoquit, uint8_t binary) {
+	static char buf[READ_BUF];
+	size_t fill = 0;
+	ssize_t n;
+	char *start, *nl;
+	int l = 0;
+	int r = 0;
+	int br;
+
+	while ((n = read(STDIN_FILENO, buf + fill, sizeof(buf) - fill - 1)) > 0) {
+		fill += n;
+		start = buf;
+		nixie_batch(dev, 1);
+		if (binary) {
+			while ((l = process_binary(dev, (uint8_t *) start, buf + fill - start)) > 0) start += l;
+			if (l == -1) {
+				/* there is no telling where the next command starts */
+				fprintf(stderr, "Unknown binary command %u\n", (uint8_t) *start);
+			}
+			if (l < 0) r = 1;
+		} else {
+			buf[fill] = '\0';
+			while (!(r && autoquit) && (nl = strchr(start, '\n'))) {
+				*nl = '\0';
+				if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+				if (*start) r = run_command(dev, start);
+				start = nl+1;
 			}
 		}
+		br = nixie_batch(dev, 0);
+		if (br && !r) r = br;
+		if ((r && autoquit) || l == -1) return r;
+		fill -= start - buf;
+		memmove(buf, start, fill);
+		if (fill == sizeof(buf)-1) {
+			/* line too long, discard it */
+			fill = 0;
+		}
 	}
-	if (target != NULL) {
-		usb_claim_interface(target, 0);
-		*handle = target;
-		return 1;
-	} else {
-		return 0;
-	}
+	return autoquit ? r : 0;
 }
 
-static int send_usb_msg(usb_dev_handle *handle, uint8_t req, uint16_t i, uint16_t v, uint8_t *buf, uint8_t l) {
-	uint8_t retry = 10;
-	int8_t sent = -1;
-	do {
-		sent = usb_control_msg(handle,
-			USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
-			req,
-			i, v,
-			buf, l,
-			100);
-	} while (sent < l && retry-- && (usleep(5000) == 0));
-
-	if (sent < l) {
-		perror("Error sending command");
-		return 1;
+static int read_cmds(struct nixie *dev, uint8_t autoquit) {
+	char *l = NULL;
+	/* readline is only worth its cost for a human at the keyboard */
+	if (!isatty(STDIN_FILENO)) return read_batched(dev, autoquit, 0);
+	while (l = readline("> ")) {
+		int r = run_command(dev, l);
+		free(l);
+		if (r != 0 && autoquit) return r;
 	}
 	return 0;
 }
 
-static int send_buffer(usb_dev_handle *handle, uint8_t *buf, uint8_t l) {
-	return send_usb_msg(handle, CUSTOM_RQ_SET_NIXIE, 0, 0, buf, l);
-}
-
-static int set_tube(usb_dev_handle *handle, uint8_t tube, uint8_t value) {
-	uint8_t buf[8];
-	buf[0] = CUSTOM_RQ_CONST_TUBE;
-	buf[1] = (uint8_t) tube;
-	buf[2] = (uint8_t) value;
-	return send_buffer(handle, buf, sizeof(buf));
-}
-
-static int set_led(usb_dev_handle *handle, uint8_t led, uint8_t r, uint8_t g, uint8_t b) {
-	uint8_t buf[8];
-	buf[0] = CUSTOM_RQ_CONST_LED;
-	buf[1] = (uint8_t) led;
-	buf[2] = (uint8_t) r;
-	buf[3] = (uint8_t) g;
-	buf[4] = (uint8_t) b;
-	return send_buffer(handle, buf, sizeof(buf));
-}
-
-static int set_animation(usb_dev_handle *handle, uint8_t style, uint8_t speed) {
-	uint8_t buf[8];
-	buf[0] = CUSTOM_RQ_CONST_ANIMATION;
-	buf[1] = (uint8_t) 0; /* not used yet */
-	buf[2] = (uint8_t) style;
-	buf[3] = (uint8_t) speed;
-	return send_buffer(handle, buf, sizeof(buf));
-}
-
-static int set_number(usb_dev_handle *handle, int number, uint8_t leading_zero) {
-	int i = 0;
-	while (number || i < MAX_DIGITS) { /* handle at least MAX_DIGITS tubes until we have a reset function */
-		uint8_t v = number % 10;
-		if (!leading_zero && number == 0 && i != 0) v = TUBE_OFF; /* deactivate leading 0s */
-		int r = set_tube(handle, i, v);
-		number /= 10;
-		if (r) return r;
-		i++;
-	}
-	return 0;
-}
+/* state shared with the readline callback while streaming */
+static struct nixie *stream_dev = NULL;
+static uint8_t stream_eof = 0;
 
-static int set_color(usb_dev_handle *handle, uint8_t r, uint8_t g, uint8_t b) {
-	int i = 0;
-	while (i < MAX_DIGITS) { /* handle at least MAX_DIGITS tubes until we have a reset function */
-		int res = set_led(handle, i++, r, g, b);
-		if (res) return res;
+static void stream_line(char *l) {
+	if (l == NULL) {
+		stream_eof = 1;
+		return;
 	}
-	return 0;
+	run_command(stream_dev, l);
+	free(l);
 }
 
-static int tubes_off(usb_dev_handle *handle) {
-	int i = 0;
-	/* this should probably be done by the firmware */
-	while (i < MAX_DIGITS) { /* handle at least MAX_DIGITS tubes until we have a reset function */
-		int res = set_tube(handle, i++, TUBE_OFF);
-		if (res) return res;
-	}
-	return 0;
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-static int process_command(usb_dev_handle *handle, char *cmd);
+/* read commands from stdin and push the resulting frame at a fixed rate */
+static int stream_cmds(struct nixie *dev, int rate) {
+	double period = 1.0 / rate;
+	double next = now();
+	int r = 0;
 
-static int read_cmds(usb_dev_handle *handle, uint8_t autoquit) {
-	char *l = NULL;
-	while (l = readline("> ")) {
-		int r = process_command(handle, l);
-		free(l);
-		if (r != 0 && autoquit) return r;
+	dev->streaming = 1;
+	stream_dev = dev;
+	stream_eof = 0;
+
+	rl_callback_handler_install("> ", stream_line);
+	while (!stream_eof) {
+		double wait = next - now();
+		if (wait <= 0) {
+			if ((r = send_stream(dev)) != 0) break;
+			next += period;
+			/* do not try to catch up on frames we already missed */
+			if (next < now()) next = now() + period;
+			continue;
+		}
+		fd_set fds;
+		struct timeval tv = { .tv_sec = (long) wait, .tv_usec = (long) ((wait - (long) wait) * 1e6) };
+		FD_ZERO(&fds);
+		FD_SET(fileno(rl_instream ? rl_instream : stdin), &fds);
+		if (select(fileno(rl_instream ? rl_instream : stdin)+1, &fds, NULL, NULL, &tv) > 0) {
+			rl_callback_read_char();
+		}
+		nixie_poll(dev);
 	}
-	return 0;
+	rl_callback_handler_remove();
+	/* push the final state of the stream */
+	if (r == 0) r = send_stream(dev);
+	dev->streaming = 0;
+	return r;
 }
 
-static int process_command(usb_dev_handle *handle, char *cmd) {
-	int tube = 0;
-	int value = 0;
-	int anim = 0;
-	int speed = 0;
-	int r = 0;
-	int g = 0;
-	int b = 0;
-	if (sscanf(cmd, "t%d:%d", &tube, &value) == 2 && tube >= 0 && value >= 0) {
-		printf("Setting nixie tube %u to %u.\n", tube, value);
-		return set_tube(handle, tube, value);
-	} else if (sscanf(cmd, "l%d:%d/%d/%d", &tube, &r, &g, &b) == 4 && tube >= 0) {
-		printf("Setting nixie LED %u to %u/%u/%u.\n", tube, r, g, b);
-		return set_led(handle, tube, r, g, b);
-	} else if (sscanf(cmd, "anim:%d:%d", &anim, &speed) == 2 && anim >= 0 && anim >= 0) {
-		printf("Setting animation style %u with speed %u.\n", anim, speed);
-		return set_animation(handle, anim, speed);
-	} else if (sscanf(cmd, "lnum:%d", &value) == 1 && value >= 0) {
-		printf("Setting number %u\n", value);
-		return set_number(handle, value, 1);
-	} else if (sscanf(cmd, "num:%d", &value) == 1 && value >= 0) {
-		printf("Setting number %u\n", value);
-		return set_number(handle, value, 0);
-	} else if (sscanf(cmd, "color:%d/%d/%d", &r, &g, &b) == 3) {
-		printf("Setting color %u/%u/%u\n", r, g, b);
-		return set_color(handle, r, g, b);
-	} else if (strcmp(cmd, "off") == 0) {
-		printf("Turning off all tubes...\n");
-		return tubes_off(handle);
+/* a read mode is running, see run_command() */
+static uint8_t reading = 0;
+
+/* the read modes are only available from the command line */
+static int run_command(struct nixie *dev, char *cmd) {
+	int rate = 0;
+	int r = process_command(dev, cmd, stdout);
+	if (r != 2) {
+		return r;
+	} else if (dev->streaming || reading) {
+		/* read modes do not nest, they share stdin and its buffer */
+	} else if (sscanf(cmd, "stream:%d", &rate) == 1 && rate > 0) {
+		if (!(dev->features & NIXIE_FEATURE_STREAMING)) {
+			fprintf(stderr, "The device does not support streaming\n");
+			return 1;
+		}
+		printf("Streaming commands from stdin at %u frames/s...\n", rate);
+		return stream_cmds(dev, rate);
 	} else if (strcmp(cmd, "read") == 0) {
 		printf("Reading commands from stdin...\n");
-		return read_cmds(handle, 0);
+		reading = 1;
+		r = read_cmds(dev, 0);
+		reading = 0;
+		return r;
 	} else if (strcmp(cmd, "readf") == 0) {
 		printf("Reading commands from stdin (autofail)...\n");
-		return read_cmds(handle, 1);
-	} else {
-		fprintf(stderr, "Unable to parse command: %s\n", cmd);
-		return 2;
+		reading = 1;
+		r = read_cmds(dev, 1);
+		reading = 0;
+		return r;
+	} else if (strcmp(cmd, "readb") == 0) {
+		printf("Reading binary commands from stdin...\n");
+		reading = 1;
+		r = read_batched(dev, 1, 1);
+		reading = 0;
+		return r;
 	}
-	return 0;
-
+	fprintf(stderr, "Unable to parse command: %s\n", cmd);
+	return 2;
 }
 
 int main(int argc, char *argv[]) {
-	usb_dev_handle *handle = NULL;
-	int usb_present = open_usb(&handle);
-	if (!handle) {
+	struct nixie dev;
+	if (!nixie_open(&dev)) {
 		perror("Unable to open usb device");
 		return 1;
 	}
@@ -207,9 +186,9 @@ int main(int argc, char *argv[]) {
 	argc--;
 	argv++;
 	while (argc) {
-		int result = process_command(handle, argv[0]);
+		int result = run_command(&dev, argv[0]);
 		if (result == 1) {
-			usb_close(handle);
+			nixie_close(&dev);
 			return 1;
 		} else if (result == 2) {
 			fprintf(stderr, "Unable to parse command line item: %s\n", argv[0]);
@@ -217,6 +196,11 @@ int main(int argc, char *argv[]) {
 		argc--;
 		argv++;
 	}
-	usb_close(handle);
+	/* requests are still on their way */
+	if (nixie_wait(&dev)) {
+		nixie_close(&dev);
+		return 1;
+	}
+	nixie_close(&dev);
 	return 0;
 }
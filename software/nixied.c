@@ -0,0 +1,343 @@
+/*
+ * nixied.c
+ *
+ * Keeps the nixie display open and accepts the command grammar of
+ * nixie from any number of clients connected to a unix domain socket,
+ * e.g.: echo num:42 | socat - UNIX-CONNECT:/var/run/nixied.sock
+ * With -m, clients can also draw into the framebuffer of nixie-shm.h.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "device.h"
+#include "command.h"
+#include "nixie-shm.h"
+
+#if NIXIE_SHM_TUBES != MAX_TUBES
+#error "NIXIE_SHM_TUBES must match MAX_TUBES"
+#endif
+
+#define DEFAULT_SOCKET "/var/run/nixied.sock"
+/* resend the whole display state this often (seconds) */
+#define DEFAULT_REFRESH 30
+
+#define MAX_CLIENTS 16
+/* file descriptors libusb may ask us to watch */
+#define MAX_USB_FDS 8
+#define MAX_LINE 256
+#define BATCH_ERROR "Error sending command\n"
+
+struct client {
+	int fd;
+	size_t fill;
+	char buf[MAX_LINE];
+};
+
+static struct client clients[MAX_CLIENTS];
+static volatile sig_atomic_t running = 1;
+
+/* the shared framebuffer and its layers as last shown */
+static struct nixie_shm *fb = NULL;
+static struct nixie_shm_layer fb_layer[NIXIE_SHM_LAYERS];
+/* the update each layer was last seen in, and since when */
+static uint32_t fb_busy_seq[NIXIE_SHM_LAYERS];
+static double fb_busy_since[NIXIE_SHM_LAYERS];
+
+static void stop(int sig) {
+	running = 0;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the framebuffer is kept across restarts, clients stay attached to it */
+static struct nixie_shm *create_fb(void) {
+	struct nixie_shm *f;
+	int fd = shm_open(NIXIE_SHM_NAME, O_RDWR | O_CREAT, 0660);
+	if (fd < 0 || ftruncate(fd, sizeof(*f)) < 0) {
+		perror("Unable to create the framebuffer");
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	f = mmap(NULL, sizeof(*f), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (f == MAP_FAILED) {
+		perror("Unable to map the framebuffer");
+		return NULL;
+	}
+	if (f->magic != NIXIE_SHM_MAGIC || f->version != NIXIE_SHM_VERSION) {
+		memset(f, 0, sizeof(*f));
+		f->version = NIXIE_SHM_VERSION;
+		__atomic_store_n(&f->magic, NIXIE_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+	return f;
+}
+
+/* copy the layers clients are done updating, returns whether any changed */
+static uint8_t read_fb(void) {
+	struct nixie_shm_layer l;
+	uint32_t seq;
+	uint8_t changed = 0;
+	int i;
+	for (i = 0; i < NIXIE_SHM_LAYERS; i++) {
+		seq = __atomic_load_n(&fb->layer[i].seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			if (seq != fb_busy_seq[i]) {
+				fb_busy_seq[i] = seq;
+				fb_busy_since[i] = now();
+				continue;
+			}
+			/* wait for the update unless its client is gone */
+			if (now() - fb_busy_since[i] < NIXIE_SHM_STALE_MS / 1000.0) continue;
+		}
+		if (seq == fb_layer[i].seq) continue;
+		memcpy(&l, &fb->layer[i], sizeof(l));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* the client started another update while we copied */
+		if (__atomic_load_n(&fb->layer[i].seq, __ATOMIC_RELAXED) != seq) continue;
+		l.seq = seq;
+		fb_layer[i] = l;
+		changed = 1;
+	}
+	return changed;
+}
+
+/* show the topmost digit and color set for each tube, tubes no layer
+ * sets keep what they show */
+static int show_fb(struct nixie *dev) {
+	uint8_t t;
+	int i;
+	nixie_batch(dev, 1);
+	for (t = 0; t < dev->tubes; t++) {
+		for (i = NIXIE_SHM_LAYERS-1; i >= 0; i--) {
+			if (fb_layer[i].tubes & (uint32_t) 1 << t) {
+				set_tube(dev, t, fb_layer[i].tube[t]);
+				break;
+			}
+		}
+		for (i = NIXIE_SHM_LAYERS-1; i >= 0; i--) {
+			if (fb_layer[i].leds & (uint32_t) 1 << t) {
+				set_led(dev, t, fb_layer[i].led[t][0], fb_layer[i].led[t][1], fb_layer[i].led[t][2]);
+				break;
+			}
+		}
+	}
+	return nixie_batch(dev, 0);
+}
+
+static int listen_socket(const char *path) {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("Unable to create socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, MAX_CLIENTS) < 0) {
+		perror("Unable to bind socket");
+		close(fd);
+		return -1;
+	}
+	chmod(path, 0660);
+	return fd;
+}
+
+static void accept_client(int lfd) {
+	int i;
+	int fd = accept(lfd, NULL, NULL);
+	if (fd < 0) return;
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = fd;
+			clients[i].fill = 0;
+			return;
+		}
+	}
+	/* no free slot left */
+	close(fd);
+}
+
+static void drop_client(struct client *c) {
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* run a single command line and report back to the client */
+static void run_line(struct nixie *dev, struct client *c, char *line) {
+	char *reply = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&reply, &len);
+	int r;
+	if (!out) return;
+	r = process_command(dev, line, out);
+	if (r == 1) {
+		fprintf(out, "Error sending command\n");
+	} else if (r == 2) {
+		fprintf(out, "Unable to parse command: %s\n", line);
+	}
+	fclose(out);
+	/* never let a slow client block the display */
+	send(c->fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	free(reply);
+}
+
+static void read_client(struct nixie *dev, struct client *c) {
+	char *start, *nl;
+	ssize_t n = read(c->fd, c->buf + c->fill, sizeof(c->buf) - c->fill - 1);
+	if (n <= 0) {
+		drop_client(c);
+		return;
+	}
+	c->fill += n;
+	c->buf[c->fill] = '\0';
+	start = c->buf;
+	/* the lines of one read go out together */
+	nixie_batch(dev, 1);
+	while ((nl = strchr(start, '\n'))) {
+		*nl = '\0';
+		if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+		if (*start) run_line(dev, c, start);
+		start = nl+1;
+	}
+	if (nixie_batch(dev, 0)) {
+		send(c->fd, BATCH_ERROR, strlen(BATCH_ERROR), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	c->fill -= start - c->buf;
+	memmove(c->buf, start, c->fill);
+	if (c->fill == sizeof(c->buf)-1) {
+		/* line too long, discard it */
+		c->fill = 0;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	struct nixie dev;
+	const char *path = DEFAULT_SOCKET;
+	int refresh = DEFAULT_REFRESH;
+	uint8_t background = 0;
+	int fb_rate = 0;
+	double frame_at = 0;
+	struct pollfd fds[MAX_CLIENTS+1+MAX_USB_FDS];
+	int lfd;
+	int opt;
+	int n_usb;
+	int timeout;
+	int usb_timeout;
+	int i;
+
+	while ((opt = getopt(argc, argv, "s:r:m:d")) != -1) {
+		switch (opt) {
+			case 's':
+				path = optarg;
+				break;
+			case 'r':
+				refresh = atoi(optarg);
+				break;
+			case 'm':
+				fb_rate = atoi(optarg);
+				break;
+			case 'd':
+				background = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-d] [-s socket] [-r refresh] [-m frames/s]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	lfd = listen_socket(path);
+	if (lfd < 0) return 1;
+	if (fb_rate > 0 && !(fb = create_fb())) {
+		close(lfd);
+		unlink(path);
+		return 1;
+	}
+	/* libusb's threads and hotplug state do not survive a fork,
+	 * so the device is only opened by the daemon */
+	if (background && daemon(0, 0) < 0) {
+		perror("Unable to daemonize");
+		close(lfd);
+		unlink(path);
+		return 1;
+	}
+	if (!nixie_open(&dev)) {
+		perror("Unable to open usb device");
+		close(lfd);
+		unlink(path);
+		return 1;
+	}
+	dev.refresh = refresh;
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	while (running) {
+		fds[0].fd = lfd;
+		fds[0].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			fds[i+1].fd = clients[i].fd;
+			fds[i+1].events = POLLIN;
+		}
+		n_usb = nixie_pollfds(&dev, &fds[MAX_CLIENTS+1], MAX_USB_FDS);
+		/* wake up for the periodic refresh even without clients,
+		 * and whenever a retry is due */
+		timeout = dev.refresh ? dev.refresh*1000 : -1;
+		usb_timeout = nixie_timeout(&dev);
+		if (usb_timeout >= 0 && (timeout < 0 || usb_timeout < timeout)) timeout = usb_timeout;
+		if (fb) {
+			/* look at the framebuffer once per frame */
+			int fb_timeout = (frame_at > now()) ? (int) ((frame_at - now()) * 1000) + 1 : 0;
+			if (timeout < 0 || fb_timeout < timeout) timeout = fb_timeout;
+		}
+		if (poll(fds, MAX_CLIENTS+1+n_usb, timeout) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+		nixie_poll(&dev);
+		nixie_flush(&dev);
+		/* clients are served one after another, so access to the device is serialized */
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			if (clients[i].fd >= 0 && fds[i+1].revents) {
+				read_client(&dev, &clients[i]);
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			accept_client(lfd);
+		}
+		if (fb && now() >= frame_at) {
+			frame_at = now() + 1.0 / fb_rate;
+			fb->display_tubes = dev.tubes;
+			if (read_fb()) show_fb(&dev);
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0) drop_client(&clients[i]);
+	}
+	close(lfd);
+	unlink(path);
+	nixie_close(&dev);
+	return 0;
+}
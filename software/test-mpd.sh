@@ -0,0 +1,43 @@
+#!/bin/bash
+#
+# Plays mpd to nixie-mpd over its stdin and stdout (-h -) and checks the
+# commands it sends back, e.g.: ./test-mpd.sh ./nixie-mpd-mock
+# Replies come split within lines and several at once, the way they
+# may arrive from a socket.
+
+nixie_mpd=${1:-./nixie-mpd-mock}
+
+coproc MPD { exec "$nixie_mpd" -h - 2>/dev/null; }
+
+fail() {
+	echo "FAIL: $*"
+	kill "$MPD_PID" 2>/dev/null
+	exit 1
+}
+
+say() {
+	printf "$1" >&"${MPD[1]}"
+}
+
+expect() {
+	local line
+	read -r -t 5 line <&"${MPD[0]}" || fail "no command, expected '$1'"
+	[ "$line" = "$1" ] || fail "got '$line', expected '$1'"
+}
+
+say 'OK MPD 0.23.5\n'
+expect 'status'
+say 'volume: 40\nstate: play\nsong: 3\nelap'
+sleep 0.2
+say 'sed: 10.500\nduration: 200.000\nOK\n'
+expect 'idle player mixer'
+# idle returns with the status it asks for right behind it
+say 'changed: mixer\nOK\nvolume: 55\nstate: play\nsong: 3\nelapsed: 12.000\nduration: 200.000\nOK\n'
+expect 'status'
+expect 'idle player mixer'
+say 'changed: player\nOK\n'
+expect 'status'
+# an error drops the connection, there is nothing to connect to again
+say 'ACK [50@0] {status} no such song\n'
+wait "$MPD_PID" || fail "nixie-mpd exited with $?"
+echo "OK"